@@ -0,0 +1,609 @@
+/*
+ * Benchmark suite for RefBitClock Cache, for the host shim and for ESP-IDF targets
+ * Copyright (c) 2025 Eungsuk Jeon
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "refbit_clock_cache.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef BENCH_HOST
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#ifndef BENCH_OPS_PER_THREAD
+#ifdef BENCH_HOST
+#define BENCH_OPS_PER_THREAD 200000
+#else
+#define BENCH_OPS_PER_THREAD 10000
+#endif
+#endif
+
+#define BENCH_MAX_THREADS 16
+
+typedef enum
+{
+    WORKLOAD_UNIFORM,
+    WORKLOAD_ZIPF,
+    WORKLOAD_SCAN,
+    WORKLOAD_MIXED, // Zipfian, with every fourth access taken from a sequential scan
+    WORKLOAD_COUNT
+} BenchWorkload;
+
+static const char* const workload_names[WORKLOAD_COUNT] = {"uniform", "zipf", "scan", "mixed"};
+
+typedef struct
+{
+    BenchWorkload workload;
+    int num_keys;
+    int cache_size;
+    int threads;
+    int ops_per_thread;
+    float zipf_theta;
+    int hold_us;
+    int value_size;
+    int eviction_policy;
+    int front_entries;
+    int inline_value_size;
+    int lock_spin;
+    int lock_timing;
+} BenchConfig;
+
+/*
+ * Latency histogram with HIST_SUB buckets per power of two, so every
+ * percentile is reported within 1/HIST_SUB of the measured value.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (40 * HIST_SUB)
+
+typedef struct
+{
+    unsigned int counts[HIST_BUCKETS];
+    unsigned int total;
+} LatencyHist;
+
+static int histBucket(uint64_t ns)
+{
+    if (ns < HIST_SUB)
+    {
+        return (int)ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - HIST_SUB_BITS;
+    int bucket = (shift + 1) * HIST_SUB + (int)((ns >> shift) & (HIST_SUB - 1));
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+// Lower bound of a bucket, the inverse of histBucket().
+static uint64_t histValue(int bucket)
+{
+    if (bucket < HIST_SUB)
+    {
+        return bucket;
+    }
+    int shift = bucket / HIST_SUB - 1;
+    return (uint64_t)(HIST_SUB + bucket % HIST_SUB) << shift;
+}
+
+static void histAdd(LatencyHist* hist, uint64_t ns)
+{
+    hist->counts[histBucket(ns)]++;
+    hist->total++;
+}
+
+static void histMerge(LatencyHist* into, const LatencyHist* from)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+}
+
+static uint64_t histPercentile(const LatencyHist* hist, double q)
+{
+    unsigned int rank = (unsigned int)(q * hist->total);
+    unsigned int seen = 0;
+
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist->counts[i];
+        if (seen > rank)
+        {
+            return histValue(i);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Allocation counting wraps malloc at link time (-Wl,--wrap=malloc), which
+ * catches the cache's own allocations on the host and on target alike.
+ */
+#ifdef BENCH_COUNT_ALLOCS
+static unsigned int bench_allocs;
+
+void* __real_malloc(size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+#endif
+
+static unsigned int allocCount(void)
+{
+#ifdef BENCH_COUNT_ALLOCS
+    return __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+#else
+    return 0;
+#endif
+}
+
+// esp_timer only resolves microseconds, so target latencies are multiples of 1000 ns.
+static uint64_t benchNowNs(void)
+{
+#ifdef BENCH_HOST
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+#else
+    return (uint64_t)esp_timer_get_time() * 1000u;
+#endif
+}
+
+typedef struct
+{
+    const BenchConfig* config;
+    RefBitClockCache* cache;
+    const char** keys;
+    float* zipf_cdf;
+    SemaphoreHandle_t start_sem;
+    SemaphoreHandle_t done_sem;
+} BenchShared;
+
+typedef struct
+{
+    BenchShared* shared;
+    uint32_t rng;
+    int scan_pos;
+    unsigned char* value;
+    unsigned int hits;
+    unsigned int misses;
+    LatencyHist hit_latency;
+    LatencyHist miss_latency;
+} BenchTask;
+
+static uint32_t nextRandom(BenchTask* t)
+{
+    t->rng ^= t->rng << 13;
+    t->rng ^= t->rng >> 17;
+    t->rng ^= t->rng << 5;
+    return t->rng;
+}
+
+// CDF of a Zipfian distribution over ranks 0..n-1 for inverse-transform sampling.
+static float* buildZipfCdf(int n, float theta)
+{
+    float* cdf = (float*)malloc(n * sizeof(float));
+    if (!cdf)
+    {
+        return NULL;
+    }
+
+    double sum = 0.0;
+    for (int i = 0; i < n; i++)
+    {
+        sum += 1.0 / pow(i + 1, theta);
+        cdf[i] = (float)sum;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        cdf[i] /= (float)sum;
+    }
+    return cdf;
+}
+
+static int zipfKey(BenchTask* t)
+{
+    float u = (nextRandom(t) >> 8) * (1.0f / 16777216.0f);
+    const float* cdf = t->shared->zipf_cdf;
+    int lo = 0;
+    int hi = t->shared->config->num_keys - 1;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (cdf[mid] < u)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int scanKey(BenchTask* t)
+{
+    int key = t->scan_pos;
+    t->scan_pos = (t->scan_pos + 1) % t->shared->config->num_keys;
+    return key;
+}
+
+static int nextKey(BenchTask* t, int op)
+{
+    switch (t->shared->config->workload)
+    {
+    case WORKLOAD_ZIPF:
+        return zipfKey(t);
+    case WORKLOAD_SCAN:
+        return scanKey(t);
+    case WORKLOAD_MIXED:
+        return op % 4 == 3 ? scanKey(t) : zipfKey(t);
+    default:
+        return nextRandom(t) % t->shared->config->num_keys;
+    }
+}
+
+static void benchTaskFunc(void* arg)
+{
+    BenchTask* t = (BenchTask*)arg;
+    BenchShared* shared = t->shared;
+    const BenchConfig* config = shared->config;
+
+    xSemaphoreTake(shared->start_sem, portMAX_DELAY);
+
+    for (int op = 0; op < config->ops_per_thread; op++)
+    {
+        const char* key = shared->keys[nextKey(t, op)];
+
+        // Get-or-fill: a hit is one lookup, a miss adds the insert that fills the slot.
+        uint64_t start = benchNowNs();
+        CacheValue* cv = lookupCache(shared->cache, key);
+        int hit = cv != NULL;
+        if (!cv)
+        {
+            cv = insertCache(shared->cache, key, t->value, config->value_size);
+        }
+        uint64_t elapsed = benchNowNs() - start;
+
+        if (cv && config->hold_us > 0)
+        {
+            uint64_t until = benchNowNs() + (uint64_t)config->hold_us * 1000u;
+            while (benchNowNs() < until)
+            {
+            }
+        }
+
+        start = benchNowNs();
+        releaseValue(shared->cache, cv);
+        elapsed += benchNowNs() - start;
+
+        if (hit)
+        {
+            t->hits++;
+            histAdd(&t->hit_latency, elapsed);
+        }
+        else
+        {
+            t->misses++;
+            histAdd(&t->miss_latency, elapsed);
+        }
+    }
+
+    xSemaphoreGive(shared->done_sem);
+    vTaskDelete(NULL);
+}
+
+static void printLatency(const char* label, const LatencyHist* hist)
+{
+    if (hist->total == 0)
+    {
+        printf("    %-4s -\n", label);
+        return;
+    }
+    printf("    %-4s p50 %llu ns, p99 %llu ns, p999 %llu ns\n", label,
+           (unsigned long long)histPercentile(hist, 0.50), (unsigned long long)histPercentile(hist, 0.99),
+           (unsigned long long)histPercentile(hist, 0.999));
+}
+
+// One count per REFBIT_CACHE_LOCK_BUCKETS bucket: <1 us, <2 us, <4 us, ...
+static void printLockHist(const char* label, const unsigned int* hist, unsigned int max_us)
+{
+    printf("    lock %s", label);
+    for (int i = 0; i < REFBIT_CACHE_LOCK_BUCKETS; i++)
+    {
+        printf(" %u", hist[i]);
+    }
+    printf(", max %u us\n", max_us);
+}
+
+static int runBenchmark(const BenchConfig* config)
+{
+    if (config->threads < 1 || config->threads > BENCH_MAX_THREADS || config->num_keys < 1 ||
+        config->ops_per_thread < 1 || config->value_size < 1)
+    {
+        ESP_LOGE(CACHE_TAG, "Invalid benchmark configuration");
+        return 0;
+    }
+
+    RefBitClockCacheConfig cache_config = REFBIT_CACHE_DEFAULT_CONFIG();
+    cache_config.cache_size = config->cache_size;
+    cache_config.eviction_policy = config->eviction_policy;
+    cache_config.front_entries = config->front_entries;
+    cache_config.inline_value_size = config->inline_value_size;
+    cache_config.lock_spin = config->lock_spin;
+    cache_config.lock_timing = config->lock_timing;
+
+    BenchShared shared;
+    memset(&shared, 0, sizeof(BenchShared));
+    shared.config = config;
+    shared.cache = createCacheWithConfig(&cache_config);
+    shared.keys = (const char**)malloc(config->num_keys * sizeof(char*));
+    char* key_text = (char*)malloc(config->num_keys * 16);
+    shared.zipf_cdf = buildZipfCdf(config->num_keys, config->zipf_theta);
+    shared.start_sem = xSemaphoreCreateCounting(config->threads, 0);
+    shared.done_sem = xSemaphoreCreateCounting(config->threads, 0);
+    BenchTask* tasks = (BenchTask*)calloc(config->threads, sizeof(BenchTask));
+
+    int ok = shared.cache && shared.keys && key_text && shared.zipf_cdf && shared.start_sem && shared.done_sem && tasks;
+    for (int i = 0; ok && i < config->threads; i++)
+    {
+        tasks[i].shared = &shared;
+        tasks[i].rng = 0x9e3779b9u * (i + 1);
+        tasks[i].scan_pos = (int)((long)config->num_keys * i / config->threads);
+        tasks[i].value = (unsigned char*)malloc(config->value_size);
+        ok = tasks[i].value != NULL;
+        if (ok)
+        {
+            memset(tasks[i].value, i, config->value_size);
+        }
+    }
+    for (int i = 0; ok && i < config->num_keys; i++)
+    {
+        snprintf(key_text + i * 16, 16, "bench-%d", i);
+        shared.keys[i] = key_text + i * 16;
+    }
+
+    int started = 0;
+    for (int i = 0; ok && i < config->threads; i++)
+    {
+        char task_name[24];
+        snprintf(task_name, sizeof(task_name), "bench_%d", i);
+        if (xTaskCreate(benchTaskFunc, task_name, 4096, &tasks[i], 5, NULL) != pdPASS)
+        {
+            ESP_LOGE(CACHE_TAG, "Failed to create task %d", i);
+            ok = 0;
+            break;
+        }
+        started++;
+    }
+    if (!ok)
+    {
+        ESP_LOGE(CACHE_TAG, "Failed to set up benchmark");
+    }
+
+    // Tasks that did start run to completion even on failure, so their memory can be freed.
+    unsigned int allocs = allocCount();
+    uint64_t start = benchNowNs();
+    for (int i = 0; i < started; i++)
+    {
+        xSemaphoreGive(shared.start_sem);
+    }
+    for (int i = 0; i < started; i++)
+    {
+        xSemaphoreTake(shared.done_sem, portMAX_DELAY);
+    }
+    uint64_t elapsed = benchNowNs() - start;
+    allocs = allocCount() - allocs;
+
+    if (ok)
+    {
+        LatencyHist* hit_latency = (LatencyHist*)calloc(2, sizeof(LatencyHist));
+        LatencyHist* miss_latency = hit_latency + 1;
+        unsigned int hits = 0;
+        unsigned int misses = 0;
+        for (int i = 0; hit_latency && i < config->threads; i++)
+        {
+            hits += tasks[i].hits;
+            misses += tasks[i].misses;
+            histMerge(hit_latency, &tasks[i].hit_latency);
+            histMerge(miss_latency, &tasks[i].miss_latency);
+        }
+
+        unsigned int ops = hits + misses;
+        RefBitClockCacheStats stats;
+        getCacheStats(shared.cache, &stats);
+
+        printf("%-7s keys=%d cache=%d threads=%d hold=%dus value=%dB policy=%s front=%d inline=%d spin=%d\n",
+               workload_names[config->workload], config->num_keys, config->cache_size, config->threads, config->hold_us,
+               config->value_size, config->eviction_policy == REFBIT_CACHE_POLICY_GCLOCK ? "gclock" : "clock",
+               config->front_entries, config->inline_value_size, config->lock_spin);
+        printf("    %.0f ops/s, hit ratio %.3f", ops / (elapsed / 1e9), ops ? (double)hits / ops : 0.0);
+#ifdef BENCH_COUNT_ALLOCS
+        printf(", %.3f allocs/op", ops ? (double)allocs / ops : 0.0);
+#endif
+        printf(", evictions %u, avg sweep %.1f, avg probe %.2f", stats.evictions, stats.avg_sweep, stats.avg_probe);
+        if (config->front_entries)
+        {
+            printf(", front hits %u", stats.front_hits);
+        }
+        printf("\n");
+        if (config->lock_timing)
+        {
+            printLockHist("wait", stats.lock_wait_hist, stats.max_lock_wait);
+            printLockHist("hold", stats.lock_hold_hist, stats.max_lock_hold);
+        }
+        if (hit_latency)
+        {
+            printLatency("hit", hit_latency);
+            printLatency("miss", miss_latency);
+        }
+        free(hit_latency);
+    }
+
+    for (int i = 0; tasks && i < config->threads; i++)
+    {
+        free(tasks[i].value);
+    }
+    free(tasks);
+    if (shared.done_sem)
+    {
+        vSemaphoreDelete(shared.done_sem);
+    }
+    if (shared.start_sem)
+    {
+        vSemaphoreDelete(shared.start_sem);
+    }
+    free(shared.zipf_cdf);
+    free(key_text);
+    free(shared.keys);
+    if (shared.cache)
+    {
+        freeCache(shared.cache);
+    }
+    return ok;
+}
+
+#define BENCH_CONFIG(workload_, keys_, cache_, threads_, ops_, hold_us_, policy_) \
+    { (workload_), (keys_), (cache_), (threads_), (ops_), 0.99f, (hold_us_), 32, (policy_), 0, 0, 0, 0 }
+
+// The default suite: one line per workload, then contention, scan resistance and held values.
+static const BenchConfig bench_suite[] = {
+    BENCH_CONFIG(WORKLOAD_UNIFORM, 1024, 256, 4, BENCH_OPS_PER_THREAD, 0, REFBIT_CACHE_POLICY_CLOCK),
+    BENCH_CONFIG(WORKLOAD_ZIPF, 1024, 256, 1, BENCH_OPS_PER_THREAD, 0, REFBIT_CACHE_POLICY_CLOCK),
+    BENCH_CONFIG(WORKLOAD_ZIPF, 1024, 256, 4, BENCH_OPS_PER_THREAD, 0, REFBIT_CACHE_POLICY_CLOCK),
+    BENCH_CONFIG(WORKLOAD_SCAN, 1024, 256, 4, BENCH_OPS_PER_THREAD, 0, REFBIT_CACHE_POLICY_CLOCK),
+    BENCH_CONFIG(WORKLOAD_MIXED, 1024, 256, 4, BENCH_OPS_PER_THREAD, 0, REFBIT_CACHE_POLICY_CLOCK),
+    BENCH_CONFIG(WORKLOAD_MIXED, 1024, 256, 4, BENCH_OPS_PER_THREAD, 0, REFBIT_CACHE_POLICY_GCLOCK),
+    BENCH_CONFIG(WORKLOAD_ZIPF, 1024, 32, 8, BENCH_OPS_PER_THREAD / 50, 50, REFBIT_CACHE_POLICY_CLOCK),
+};
+
+static void runSuite(void)
+{
+    for (size_t i = 0; i < sizeof(bench_suite) / sizeof(bench_suite[0]); i++)
+    {
+        runBenchmark(&bench_suite[i]);
+    }
+}
+
+#ifdef BENCH_HOST
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+            "usage: %s [-w uniform|zipf|scan|mixed] [-k keys] [-c cache_size] [-t threads]\n"
+            "          [-n ops_per_thread] [-z zipf_theta] [-H hold_us] [-v value_bytes] [-g] [-f front_entries]\n"
+            "          [-i inline_value_size] [-s lock_spin] [-l]\n"
+            "Without options the default suite runs; -g selects GCLOCK eviction, -f a per-core front cache,\n"
+            "-i stores values up to that size inside the CacheValue, -s spins on the lock before blocking\n"
+            "and -l prints lock wait and hold histograms.\n",
+            prog);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc == 1)
+    {
+        runSuite();
+        return 0;
+    }
+
+    BenchConfig config = BENCH_CONFIG(WORKLOAD_ZIPF, 1024, 256, 4, BENCH_OPS_PER_THREAD, 0, REFBIT_CACHE_POLICY_CLOCK);
+    int opt;
+    while ((opt = getopt(argc, argv, "w:k:c:t:n:z:H:v:gf:i:s:l")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+        {
+            int i = 0;
+            while (i < WORKLOAD_COUNT && strcmp(optarg, workload_names[i]) != 0)
+            {
+                i++;
+            }
+            if (i == WORKLOAD_COUNT)
+            {
+                usage(argv[0]);
+                return 2;
+            }
+            config.workload = (BenchWorkload)i;
+            break;
+        }
+        case 'k':
+            config.num_keys = atoi(optarg);
+            break;
+        case 'c':
+            config.cache_size = atoi(optarg);
+            break;
+        case 't':
+            config.threads = atoi(optarg);
+            break;
+        case 'n':
+            config.ops_per_thread = atoi(optarg);
+            break;
+        case 'z':
+            config.zipf_theta = (float)atof(optarg);
+            break;
+        case 'H':
+            config.hold_us = atoi(optarg);
+            break;
+        case 'v':
+            config.value_size = atoi(optarg);
+            break;
+        case 'g':
+            config.eviction_policy = REFBIT_CACHE_POLICY_GCLOCK;
+            break;
+        case 'f':
+            config.front_entries = atoi(optarg);
+            break;
+        case 'i':
+            config.inline_value_size = atoi(optarg);
+            break;
+        case 's':
+            config.lock_spin = atoi(optarg);
+            break;
+        case 'l':
+            config.lock_timing = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    return runBenchmark(&config) ? 0 : 1;
+}
+#else
+void app_main(void)
+{
+    ESP_LOGI(CACHE_TAG, "Starting benchmark suite, free heap: %lu bytes", esp_get_free_heap_size());
+    runSuite();
+    ESP_LOGI(CACHE_TAG, "Benchmark suite completed, free heap: %lu bytes", esp_get_free_heap_size());
+}
+#endif
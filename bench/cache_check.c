@@ -0,0 +1,357 @@
+/*
+ * Regression checks for RefBitClock Cache, for the host shim and for ESP-IDF targets
+ * Copyright (c) 2025 Eungsuk Jeon
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "refbit_clock_cache.h"
+#include "sharded_refbit_clock_cache.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct
+{
+    const char* name;
+    int (*run)(void);
+} CacheCheck;
+
+static RefBitClockCacheConfig intKeyConfig(void)
+{
+    RefBitClockCacheConfig config = REFBIT_CACHE_DEFAULT_CONFIG();
+    config.cache_size = 4;
+    config.key_len = sizeof(uint32_t);
+    config.int_keys = 1;
+    return config;
+}
+
+static unsigned int lowByteHash(const void* key, size_t len)
+{
+    uint32_t k;
+    memcpy(&k, key, len);
+    return k & 0xff;
+}
+
+// Integer keys with a custom hash must still be compared: 257 and 1 collide here.
+static int checkIntKeysWithHashFn(void)
+{
+    RefBitClockCacheConfig config = intKeyConfig();
+    config.hash_fn = lowByteHash;
+    RefBitClockCache* cache = createCacheWithConfig(&config);
+    if (!cache)
+    {
+        return 0;
+    }
+
+    uint32_t key = 1;
+    int value = 1;
+    CacheValue* cv = insertCache(cache, (const char*)&key, &value, sizeof(value));
+    if (cv)
+    {
+        releaseValue(cache, cv);
+    }
+    key = 257;
+    cv = lookupCache(cache, (const char*)&key);
+    int ok = cv == NULL;
+    if (cv)
+    {
+        releaseValue(cache, cv);
+    }
+    freeCache(cache);
+    return ok;
+}
+
+typedef struct
+{
+    RefBitClockCache* cache;
+    uint32_t key;
+    int value;
+    int loads;
+    SemaphoreHandle_t started;
+    SemaphoreHandle_t release;
+    SemaphoreHandle_t done;
+    int result;
+} LoadTask;
+
+// Loads key * 100; a task with a release semaphore blocks in its loader until it is given.
+static int slowLoader(const char* key, void* ctx, void** value, size_t* value_size)
+{
+    LoadTask* t = (LoadTask*)ctx;
+    (void)key;
+    t->loads++;
+    if (t->release)
+    {
+        xSemaphoreGive(t->started);
+        xSemaphoreTake(t->release, portMAX_DELAY);
+    }
+    t->value = (int)t->key * 100;
+    *value = &t->value;
+    *value_size = sizeof(t->value);
+    return 1;
+}
+
+static void loadTask(void* arg)
+{
+    LoadTask* t = (LoadTask*)arg;
+    CacheValue* cv = getOrLoad(t->cache, (const char*)&t->key, slowLoader, t);
+    if (cv)
+    {
+        t->result = *(int*)cv->data;
+        releaseValue(t->cache, cv);
+    }
+    xSemaphoreGive(t->done);
+    vTaskDelete(NULL);
+}
+
+// Overlapping loads of different integer keys must each run their own loader.
+static int checkOverlappingIntKeyLoads(void)
+{
+    RefBitClockCacheConfig config = intKeyConfig();
+    RefBitClockCache* cache = createCacheWithConfig(&config);
+    LoadTask tasks[2];
+    memset(tasks, 0, sizeof(tasks));
+    for (int i = 0; i < 2; i++)
+    {
+        tasks[i].cache = cache;
+        tasks[i].key = (uint32_t)i + 1;
+        tasks[i].done = xSemaphoreCreateBinary();
+    }
+    tasks[0].started = xSemaphoreCreateBinary();
+    tasks[0].release = xSemaphoreCreateBinary();
+    if (!cache || !tasks[0].started || !tasks[0].release || !tasks[0].done || !tasks[1].done)
+    {
+        return 0;
+    }
+
+    xTaskCreate(loadTask, "load_1", 4096, &tasks[0], 5, NULL);
+    xSemaphoreTake(tasks[0].started, portMAX_DELAY);
+    xTaskCreate(loadTask, "load_2", 4096, &tasks[1], 5, NULL);
+    // Key 2 finishes on its own unless it was merged into the load of key 1.
+    int independent = xSemaphoreTake(tasks[1].done, pdMS_TO_TICKS(500)) == pdTRUE;
+    xSemaphoreGive(tasks[0].release);
+    xSemaphoreTake(tasks[0].done, portMAX_DELAY);
+    if (!independent)
+    {
+        xSemaphoreTake(tasks[1].done, portMAX_DELAY);
+    }
+
+    int ok = independent && tasks[0].result == 100 && tasks[1].result == 200 && tasks[1].loads == 1;
+    vSemaphoreDelete(tasks[0].started);
+    vSemaphoreDelete(tasks[0].release);
+    vSemaphoreDelete(tasks[0].done);
+    vSemaphoreDelete(tasks[1].done);
+    freeCache(cache);
+    return ok;
+}
+
+// Keys of one shard share the hash's low bits, so front slots must not be picked by them alone.
+static int checkShardedFrontCache(void)
+{
+    RefBitClockCacheConfig config = REFBIT_CACHE_DEFAULT_CONFIG();
+    config.cache_size = 64;
+    config.front_entries = 4;
+    ShardedRefBitClockCache* cache = createShardedCacheWithConfig(4, &config);
+    if (!cache)
+    {
+        return 0;
+    }
+
+    char keys[4][16];
+    int found = 0;
+    for (int i = 0; found < 4; i++)
+    {
+        snprintf(keys[found], sizeof(keys[found]), "key-%d", i);
+        if (hashCacheKey(cache->shards[0], keys[found]) % cache->num_shards == 0)
+        {
+            found++;
+        }
+    }
+    for (int round = 0; round < 8; round++)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            CacheValue* cv = accessShardedCache(cache, keys[i], &i, sizeof(i));
+            if (cv)
+            {
+                releaseShardedValue(cache, cv);
+            }
+        }
+    }
+    RefBitClockCacheStats stats;
+    getShardedCacheStats(cache, &stats);
+    freeShardedCache(cache);
+    return stats.front_hits > stats.hits / 2;
+}
+
+static void accessTwice(RefBitClockCache* cache, const char* key, int value)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        CacheValue* cv = accessCache(cache, key, &value, sizeof(value));
+        if (cv)
+        {
+            releaseValue(cache, cv);
+        }
+    }
+}
+
+// Front entries must not outgrow half of a shrunk cache, nor keep a value that left it.
+static int checkFrontAfterDetach(void)
+{
+    RefBitClockCacheConfig config = REFBIT_CACHE_DEFAULT_CONFIG();
+    config.cache_size = 16;
+    config.front_entries = 4;
+    RefBitClockCache* cache = createCacheWithConfig(&config);
+    if (!cache)
+    {
+        return 0;
+    }
+
+    int ok = !resizeCache(cache, 8 * portNUM_PROCESSORS - 1);
+    accessTwice(cache, "front", 1);
+    invalidateCache(cache, "front");
+    RefBitClockCacheStats stats;
+    getCacheStats(cache, &stats);
+    ok &= stats.front_hits == 0 && stats.deferred_frees == 0 && cache->pinned == 0;
+    freeCache(cache);
+    return ok;
+}
+
+typedef struct
+{
+    unsigned char data[2048];
+    size_t len;
+    size_t pos;
+} SnapshotBuffer;
+
+static int bufferWriter(const void* buf, size_t len, void* ctx)
+{
+    SnapshotBuffer* b = (SnapshotBuffer*)ctx;
+    if (b->len + len > sizeof(b->data))
+    {
+        return 0;
+    }
+    memcpy(b->data + b->len, buf, len);
+    b->len += len;
+    return 1;
+}
+
+static int bufferReader(void* buf, size_t len, void* ctx)
+{
+    SnapshotBuffer* b = (SnapshotBuffer*)ctx;
+    if (b->pos + len > b->len)
+    {
+        return 0;
+    }
+    memcpy(buf, b->data + b->pos, len);
+    b->pos += len;
+    return 1;
+}
+
+// Restoring into a cache with a byte budget must skip entries rather than evict live ones.
+static int checkRestoreWithinMaxBytes(void)
+{
+    static SnapshotBuffer snapshot;
+    RefBitClockCacheConfig config = REFBIT_CACHE_DEFAULT_CONFIG();
+    config.cache_size = 16;
+    RefBitClockCache* source = createCacheWithConfig(&config);
+    config.max_bytes = 200;
+    RefBitClockCache* cache = createCacheWithConfig(&config);
+    if (!source || !cache)
+    {
+        return 0;
+    }
+
+    char key[16];
+    char value[32];
+    memset(value, 'x', sizeof(value));
+    for (int i = 0; i < 16; i++)
+    {
+        snprintf(key, sizeof(key), "%s-%d", i < 2 ? "live" : "old", i);
+        CacheValue* cv = insertCache(i < 2 ? cache : source, key, value, sizeof(value));
+        releaseValue(i < 2 ? cache : source, cv);
+    }
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshotCache(source, 0, bufferWriter, &snapshot);
+    int restored = restoreCache(cache, bufferReader, &snapshot);
+
+    RefBitClockCacheStats stats;
+    getCacheStats(cache, &stats);
+    int ok = restored > 0 && stats.evictions == 0 && cache->bytes_used <= config.max_bytes;
+    freeCache(source);
+    freeCache(cache);
+    return ok;
+}
+
+// An oversized replacement that is returned uncached must not leave the old value cached.
+static int checkOversizedReplacement(void)
+{
+    RefBitClockCacheConfig config = REFBIT_CACHE_DEFAULT_CONFIG();
+    config.cache_size = 4;
+    config.max_value_bytes = 8;
+    RefBitClockCache* cache = createCacheWithConfig(&config);
+    if (!cache)
+    {
+        return 0;
+    }
+
+    char value[16] = "small";
+    CacheValue* cv = insertCache(cache, "key", value, 6);
+    releaseValue(cache, cv);
+    cv = insertCache(cache, "key", value, sizeof(value));
+    int ok = cv != NULL;
+    releaseValue(cache, cv);
+    cv = lookupCache(cache, "key");
+    ok &= cv == NULL;
+    releaseValue(cache, cv);
+    freeCache(cache);
+    return ok;
+}
+
+static const CacheCheck checks[] = {
+    {"int_keys with hash_fn", checkIntKeysWithHashFn},
+    {"overlapping int key loads", checkOverlappingIntKeyLoads},
+    {"sharded front cache", checkShardedFrontCache},
+    {"front entries after detach", checkFrontAfterDetach},
+    {"restore within max_bytes", checkRestoreWithinMaxBytes},
+    {"oversized replacement", checkOversizedReplacement},
+};
+
+// Returns the number of failed checks.
+static int runChecks(void)
+{
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++)
+    {
+        int ok = checks[i].run();
+        printf("%s %s\n", ok ? "PASS" : "FAIL", checks[i].name);
+        failed += !ok;
+    }
+    printf("%d of %d checks failed\n", failed, (int)(sizeof(checks) / sizeof(checks[0])));
+    return failed;
+}
+
+#ifdef BENCH_HOST
+int main(void)
+{
+    return runChecks() ? 1 : 0;
+}
+#else
+void app_main(void)
+{
+    runChecks();
+}
+#endif
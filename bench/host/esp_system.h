@@ -0,0 +1,26 @@
+/*
+ * Host shim for esp_system.h
+ * Copyright (c) 2025 Eungsuk Jeon
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BENCH_HOST_ESP_SYSTEM_H
+#define BENCH_HOST_ESP_SYSTEM_H
+
+#include <stdint.h>
+
+// The host has no fixed heap, so this always reports 0.
+uint32_t esp_get_free_heap_size(void);
+
+#endif // BENCH_HOST_ESP_SYSTEM_H
@@ -0,0 +1,26 @@
+/*
+ * Host shim for esp_timer.h
+ * Copyright (c) 2025 Eungsuk Jeon
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BENCH_HOST_ESP_TIMER_H
+#define BENCH_HOST_ESP_TIMER_H
+
+#include <stdint.h>
+
+// Microseconds since an arbitrary start, from CLOCK_MONOTONIC.
+int64_t esp_timer_get_time(void);
+
+#endif // BENCH_HOST_ESP_TIMER_H
@@ -0,0 +1,60 @@
+/*
+ * Host shim for the FreeRTOS core definitions used by the cache and its benchmark
+ * Copyright (c) 2025 Eungsuk Jeon
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BENCH_HOST_FREERTOS_H
+#define BENCH_HOST_FREERTOS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+
+#define pdTRUE  1
+#define pdFALSE 0
+#define pdPASS  pdTRUE
+#define pdFAIL  pdFALSE
+
+// One tick per millisecond, as in the default ESP-IDF configuration.
+#define configTICK_RATE_HZ 1000
+#define portTICK_PERIOD_MS 1
+#define portMAX_DELAY      ((TickType_t)0xffffffffu)
+#define pdMS_TO_TICKS(ms)  ((TickType_t)(ms))
+
+// Critical sections become a spinlock; host threads are never interrupts.
+typedef struct
+{
+    volatile int owner;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED { 0 }
+#define portMUX_INITIALIZE(mux) ((mux)->owner = 0)
+#define portENTER_CRITICAL(mux)                                                  \
+    do                                                                           \
+    {                                                                            \
+        while (__atomic_exchange_n(&(mux)->owner, 1, __ATOMIC_ACQUIRE))          \
+        {                                                                        \
+        }                                                                        \
+    } while (0)
+#define portEXIT_CRITICAL(mux) __atomic_store_n(&(mux)->owner, 0, __ATOMIC_RELEASE)
+
+// Two cores, as on the ESP32; a thread reports the CPU it last ran on.
+#define portNUM_PROCESSORS 2
+BaseType_t xPortGetCoreID(void);
+
+#endif // BENCH_HOST_FREERTOS_H
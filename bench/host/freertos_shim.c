@@ -0,0 +1,231 @@
+/*
+ * Host implementation of the FreeRTOS and ESP-IDF shims, backed by pthreads
+ * Copyright (c) 2025 Eungsuk Jeon
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <esp_heap_caps.h>
+#include <esp_random.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+struct HostSemaphore
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    UBaseType_t count;
+    UBaseType_t max_count;
+};
+
+typedef struct
+{
+    TaskFunction_t fn;
+    void* arg;
+} HostTaskStart;
+
+static SemaphoreHandle_t createSemaphore(UBaseType_t max_count, UBaseType_t initial_count)
+{
+    SemaphoreHandle_t sem = (SemaphoreHandle_t)malloc(sizeof(struct HostSemaphore));
+    if (!sem)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&sem->mutex, NULL);
+    pthread_cond_init(&sem->cond, NULL);
+    sem->count = initial_count;
+    sem->max_count = max_count;
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return createSemaphore(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return createSemaphore(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+    return createSemaphore(max_count, initial_count);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ticks / configTICK_RATE_HZ;
+    deadline.tv_nsec += (long)(ticks % configTICK_RATE_HZ) * (1000000000L / configTICK_RATE_HZ);
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&sem->mutex);
+    while (sem->count == 0)
+    {
+        if (ticks == portMAX_DELAY)
+        {
+            pthread_cond_wait(&sem->cond, &sem->mutex);
+        }
+        else if (pthread_cond_timedwait(&sem->cond, &sem->mutex, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+
+    BaseType_t taken = sem->count > 0;
+    if (taken)
+    {
+        sem->count--;
+    }
+    pthread_mutex_unlock(&sem->mutex);
+    return taken ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    pthread_mutex_lock(&sem->mutex);
+    BaseType_t given = sem->count < sem->max_count;
+    if (given)
+    {
+        sem->count++;
+        pthread_cond_signal(&sem->cond);
+    }
+    pthread_mutex_unlock(&sem->mutex);
+    return given ? pdTRUE : pdFALSE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    pthread_mutex_destroy(&sem->mutex);
+    pthread_cond_destroy(&sem->cond);
+    free(sem);
+}
+
+static void* runTask(void* arg)
+{
+    HostTaskStart start = *(HostTaskStart*)arg;
+    free(arg);
+    start.fn(start.arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char* name, uint32_t stack_depth, void* arg, UBaseType_t priority,
+                       TaskHandle_t* handle)
+{
+    (void)name;
+    (void)stack_depth;
+    (void)priority;
+
+    HostTaskStart* start = (HostTaskStart*)malloc(sizeof(HostTaskStart));
+    if (!start)
+    {
+        return pdFAIL;
+    }
+    start->fn = fn;
+    start->arg = arg;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, runTask, start) != 0)
+    {
+        free(start);
+        return pdFAIL;
+    }
+    pthread_detach(thread);
+    if (handle)
+    {
+        *handle = (TaskHandle_t)(uintptr_t)thread;
+    }
+    return pdPASS;
+}
+
+// Only self-deletion is supported, which is all the benchmark and cleanup tasks use.
+void vTaskDelete(TaskHandle_t task)
+{
+    if (!task)
+    {
+        pthread_exit(NULL);
+    }
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    usleep((useconds_t)ticks * (1000000 / configTICK_RATE_HZ));
+}
+
+void taskYIELD(void)
+{
+    sched_yield();
+}
+
+BaseType_t xPortGetCoreID(void)
+{
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : cpu % portNUM_PROCESSORS;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(esp_timer_get_time() / (1000000 / configTICK_RATE_HZ));
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void* heap_caps_malloc(size_t size, uint32_t caps)
+{
+    (void)caps;
+    return malloc(size);
+}
+
+void heap_caps_free(void* ptr)
+{
+    free(ptr);
+}
+
+uint32_t esp_get_free_heap_size(void)
+{
+    return 0;
+}
+
+uint32_t esp_random(void)
+{
+    static __thread uint32_t state;
+    if (!state)
+    {
+        state = (uint32_t)(uintptr_t)&state ^ (uint32_t)esp_timer_get_time() ^ 0x9e3779b9u;
+    }
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
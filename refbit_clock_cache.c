@@ -24,349 +24,3151 @@
 #include <freertos/task.h>
 #include <freertos/semphr.h>
 #include <esp_random.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+
+#if REFBIT_CACHE_TRACE >= REFBIT_CACHE_TRACE_EVENTS
+#define CACHE_TRACE(fmt, ...) ESP_LOGI(CACHE_TAG, fmt, ##__VA_ARGS__)
+#else
+#define CACHE_TRACE(fmt, ...) do { } while (0)
+#endif
+
+// Expands to the "%.*s" arguments for a key, bounded for binary keys.
+#define KEY_ARGS(cache, key) (int)((cache)->key_len ? (cache)->key_len : strlen(key)), (key)
+
+#if REFBIT_CACHE_TRACE >= REFBIT_CACHE_TRACE_STATE
+#define CACHE_TRACE_STATE(cache) printCacheStateLocked(cache)
+#else
+#define CACHE_TRACE_STATE(cache) do { } while (0)
+#endif
+
+#if REFBIT_CACHE_STATS
+#define CACHE_STAT_ADD(cache, field, n) __atomic_add_fetch(&(cache)->counters.field, (n), __ATOMIC_RELAXED)
+#define CACHE_STAT_MAX(cache, field, v) statMax(&(cache)->counters.field, (v))
+
+static void statMax(unsigned int* counter, unsigned int value)
+{
+    unsigned int current = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    while (value > current &&
+           !__atomic_compare_exchange_n(counter, &current, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+#else
+#define CACHE_STAT_ADD(cache, field, n) do { } while (0)
+#define CACHE_STAT_MAX(cache, field, v) do { } while (0)
+#endif
+
+#define CACHE_STAT_INC(cache, field) CACHE_STAT_ADD(cache, field, 1)
+
+static void recordProbe(RefBitClockCache* cache, int probes)
+{
+    (void)cache;
+    (void)probes;
+    CACHE_STAT_INC(cache, probes);
+    CACHE_STAT_ADD(cache, probe_steps, probes);
+    CACHE_STAT_MAX(cache, max_probe, probes);
+}
+
+/*
+ * Lock-free hits already pay for the shared hits counter, so probe statistics
+ * ride on it: one hit in PROBE_SAMPLE_RATE is recorded, weighted to stand for
+ * the others, and the rest add no further shared writes.
+ */
+#define PROBE_SAMPLE_RATE 16
+
+static void recordLockFreeHit(RefBitClockCache* cache, int probes)
+{
+    (void)cache;
+    (void)probes;
+#if REFBIT_CACHE_STATS
+    if (CACHE_STAT_INC(cache, hits) % PROBE_SAMPLE_RATE == 0)
+    {
+        CACHE_STAT_ADD(cache, probes, PROBE_SAMPLE_RATE);
+        CACHE_STAT_ADD(cache, probe_steps, PROBE_SAMPLE_RATE * probes);
+        CACHE_STAT_MAX(cache, max_probe, probes);
+    }
+#endif
+}
+
+static void recordSweep(RefBitClockCache* cache, int steps)
+{
+    (void)cache;
+    (void)steps;
+    CACHE_STAT_INC(cache, sweeps);
+    CACHE_STAT_ADD(cache, sweep_steps, steps);
+    CACHE_STAT_MAX(cache, max_sweep, steps);
+}
+
+static void recordLockTime(RefBitClockCache* cache, int wait, int64_t us)
+{
+    (void)cache;
+    (void)wait;
+    int bucket = 0;
+    while (bucket < REFBIT_CACHE_LOCK_BUCKETS - 1 && (us >> bucket) > 0)
+    {
+        bucket++;
+    }
+    (void)bucket;
+    if (wait)
+    {
+        CACHE_STAT_INC(cache, lock_wait_hist[bucket]);
+        CACHE_STAT_MAX(cache, max_lock_wait, (unsigned int)us);
+    }
+    else
+    {
+        CACHE_STAT_INC(cache, lock_hold_hist[bucket]);
+        CACHE_STAT_MAX(cache, max_lock_hold, (unsigned int)us);
+    }
+}
+
+// Returns 0 if the lock was not taken within ticks.
+static int cache_lock_wait(RefBitClockCache* c, TickType_t ticks)
+{
+    int64_t start = c->lock_timing ? esp_timer_get_time() : 0;
+    int taken = 0;
+
+#if portNUM_PROCESSORS > 1
+    // Most critical sections are shorter than a context switch; the holder may be on the other core.
+    for (int i = 0; i < c->lock_spin && !taken; i++)
+    {
+        taken = xSemaphoreTake(c->lock, 0) == pdTRUE;
+    }
+#endif
+    if (!taken && xSemaphoreTake(c->lock, ticks) != pdTRUE)
+    {
+        CACHE_STAT_INC(c, lock_timeouts);
+        return 0;
+    }
+
+    if (c->lock_timing)
+    {
+        c->lock_acquired = esp_timer_get_time();
+        recordLockTime(c, 1, c->lock_acquired - start);
+    }
+    return 1;
+}
 
 static void cache_lock(RefBitClockCache* c)
 {
-    xSemaphoreTake(c->lock, portMAX_DELAY);
+    cache_lock_wait(c, portMAX_DELAY);
 }
 
 static void cache_unlock(RefBitClockCache* c)
 {
+    if (c->lock_timing)
+    {
+        recordLockTime(c, 0, esp_timer_get_time() - c->lock_acquired);
+    }
     xSemaphoreGive(c->lock);
 }
 
-unsigned int next_prime(unsigned int n)
+/*
+ * Lock-free hits
+ *
+ * Writers (misses, evictions, rehash) hold the lock and bump seq to an odd
+ * value while they modify hash_table or the cache arrays. Hits probe the table
+ * without the lock, take a reference with a CAS on refcount and then check
+ * that seq did not move; otherwise they drop the reference and retry under
+ * the lock.
+ *
+ * A value is freed by whoever moves its refcount from 0 to REFCOUNT_DEAD,
+ * which stops lock-free readers from taking new references. Lock-free readers
+ * and releasers count themselves in cache->readers under the current
+ * reader_epoch. Anything they may still be looking at (a CacheValue with its
+ * key, an old hash table) goes on a retired list; flipping the epoch moves the
+ * list to waiting, and it is freed once the previous epoch's count drains.
+ * New readers only join the new epoch, so that count always reaches zero.
+ */
+#define REFCOUNT_DEAD (-1)
+
+// caps of 0 selects the default heap; either way the memory is released with free().
+static void* capsAlloc(uint32_t caps, size_t size)
 {
-    while (1)
+    return caps ? heap_caps_malloc(size, caps) : malloc(size);
+}
+
+/*
+ * Every hash table is allocated behind a header carrying its size, so a
+ * lock-free reader never pairs a table with the wrong size. mask is non-zero
+ * for fixed power-of-two tables, which index with a mask instead of modulo.
+ */
+typedef struct HashTableHeader
+{
+    struct HashTableHeader* retired_next;
+    int size;
+    unsigned int mask;
+} HashTableHeader;
+
+static HashEntry* allocHashTable(int size, unsigned int mask, uint32_t caps)
+{
+    HashTableHeader* hdr = (HashTableHeader*)capsAlloc(caps, sizeof(HashTableHeader) + size * sizeof(HashEntry));
+    if (!hdr)
     {
-        int prime = 1;
-        for (unsigned int i = 2; i * i <= n; i++)
+        return NULL;
+    }
+    hdr->retired_next = NULL;
+    hdr->size = size;
+    hdr->mask = mask;
+    HashEntry* table = (HashEntry*)(hdr + 1);
+    memset(table, 0, size * sizeof(HashEntry));
+    return table;
+}
+
+static HashTableHeader* hashTableHeader(HashEntry* table)
+{
+    return (HashTableHeader*)table - 1;
+}
+
+/*
+ * MurmurHash3 finalizer for indexes picked by a hash's low bits. The sharded
+ * wrapper spends those bits on choosing the shard, and FNV-1a leaves the
+ * others correlated for similar keys.
+ */
+static unsigned int mixHash(unsigned int h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static unsigned int homeBucket(HashEntry* table, unsigned int h)
+{
+    HashTableHeader* hdr = hashTableHeader(table);
+    return hdr->mask ? mixHash(h) & hdr->mask : h % hdr->size;
+}
+
+static unsigned int nextBucket(HashEntry* table, unsigned int h)
+{
+    HashTableHeader* hdr = hashTableHeader(table);
+    return hdr->mask ? (h + 1) & hdr->mask : (h + 1) % hdr->size;
+}
+
+static void freeHashTable(HashEntry* table)
+{
+    if (table)
+    {
+        free(hashTableHeader(table));
+    }
+}
+
+static void beginWrite(RefBitClockCache* c)
+{
+    __atomic_add_fetch(&c->seq, 1, __ATOMIC_SEQ_CST);
+}
+
+static void endWrite(RefBitClockCache* c)
+{
+    __atomic_add_fetch(&c->seq, 1, __ATOMIC_SEQ_CST);
+}
+
+// Returns the epoch to pass to exitReader().
+static int enterReader(RefBitClockCache* c)
+{
+    for (;;)
+    {
+        int epoch = __atomic_load_n(&c->reader_epoch, __ATOMIC_SEQ_CST) & 1;
+        __atomic_add_fetch(&c->readers[epoch], 1, __ATOMIC_SEQ_CST);
+        if ((int)(__atomic_load_n(&c->reader_epoch, __ATOMIC_SEQ_CST) & 1) == epoch)
         {
-            if (n % i == 0)
+            return epoch;
+        }
+        __atomic_sub_fetch(&c->readers[epoch], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void exitReader(RefBitClockCache* c, int epoch)
+{
+    __atomic_sub_fetch(&c->readers[epoch], 1, __ATOMIC_SEQ_CST);
+}
+
+static int previousEpochDrained(RefBitClockCache* c)
+{
+    int previous = (__atomic_load_n(&c->reader_epoch, __ATOMIC_SEQ_CST) & 1) ^ 1;
+    return __atomic_load_n(&c->readers[previous], __ATOMIC_SEQ_CST) == 0;
+}
+
+/*
+ * Must be called with the lock held. Readers never take the lock, and the
+ * previous epoch gains no new ones, so the wait is bounded by the longest
+ * reader already inside. Sleeps rather than yields so a preempted
+ * lower-priority reader can finish.
+ */
+static void waitForPreviousEpoch(RefBitClockCache* c)
+{
+    while (!previousEpochDrained(c))
+    {
+        vTaskDelay(1);
+    }
+}
+
+/*
+ * Must be called inside beginWrite()/endWrite(). Readers arriving now see an
+ * odd seq and leave without touching the slot arrays, and the ones already
+ * inside end up in the previous epoch, so once this returns nothing else is
+ * reading them.
+ */
+static void waitForReaders(RefBitClockCache* c)
+{
+    waitForPreviousEpoch(c);
+    __atomic_add_fetch(&c->reader_epoch, 1, __ATOMIC_SEQ_CST);
+    waitForPreviousEpoch(c);
+}
+
+/*
+ * Reference bits live in a per-slot bitmap in the cache rather than in the
+ * CacheValues, so the clock sweep reads sequential memory and gives a whole
+ * word of referenced slots their second chance with one operation.
+ */
+#define REF_BITS_PER_WORD 32
+
+static void setRefBit(RefBitClockCache* c, int idx)
+{
+    __atomic_fetch_or(&c->ref_bits[idx / REF_BITS_PER_WORD], 1u << (idx % REF_BITS_PER_WORD), __ATOMIC_RELAXED);
+}
+
+static void clearRefBit(RefBitClockCache* c, int idx)
+{
+    __atomic_fetch_and(&c->ref_bits[idx / REF_BITS_PER_WORD], ~(1u << (idx % REF_BITS_PER_WORD)), __ATOMIC_RELAXED);
+}
+
+// Records a hit on a slot for the cache's eviction policy.
+static void touchSlot(RefBitClockCache* c, int idx)
+{
+    if (c->ref_counts)
+    {
+        unsigned char count = __atomic_load_n(&c->ref_counts[idx], __ATOMIC_RELAXED);
+        if (count < c->gclock_max)
+        {
+            // A lost increment under contention only costs a little precision.
+            __atomic_store_n(&c->ref_counts[idx], count + 1, __ATOMIC_RELAXED);
+        }
+    }
+    else
+    {
+        setRefBit(c, idx);
+    }
+}
+
+static int testRefBit(RefBitClockCache* c, int idx)
+{
+    if (idx < 0)
+    {
+        return 0;
+    }
+    return (__atomic_load_n(&c->ref_bits[idx / REF_BITS_PER_WORD], __ATOMIC_RELAXED) >> (idx % REF_BITS_PER_WORD)) & 1;
+}
+
+// Reference bit, or GCLOCK counter, of a slot for debug output.
+static int slotHeat(RefBitClockCache* c, int idx)
+{
+    if (c->ref_counts && idx >= 0)
+    {
+        return __atomic_load_n(&c->ref_counts[idx], __ATOMIC_RELAXED);
+    }
+    return testRefBit(c, idx);
+}
+
+static char* valueKey(CacheValue* cv)
+{
+    return (char*)(cv + 1);
+}
+
+/*
+ * Expiry deadlines are tick counts compared with wraparound; 0 means the
+ * entry never expires.
+ */
+static TickType_t deadlineAfter(TickType_t ttl)
+{
+    if (!ttl)
+    {
+        return 0;
+    }
+    TickType_t deadline = xTaskGetTickCount() + ttl;
+    return deadline ? deadline : 1;
+}
+
+static int deadlinePassed(TickType_t deadline, TickType_t now)
+{
+    return deadline && (TickType_t)(now - deadline) < (portMAX_DELAY >> 1);
+}
+
+static TickType_t ttlTicks(int ttl_ms)
+{
+    if (ttl_ms <= 0)
+    {
+        return 0;
+    }
+    TickType_t ticks = pdMS_TO_TICKS(ttl_ms);
+    return ticks ? ticks : 1;
+}
+
+static int valueExpired(CacheValue* cv)
+{
+    return cv->expires && deadlinePassed(cv->expires, xTaskGetTickCount());
+}
+
+/*
+ * Keys are NUL-terminated strings unless key_len is set, in which case they
+ * are key_len bytes. hash_fn and key_equal replace the built-in FNV-1a and
+ * byte comparison; int_keys selects a multiplicative hash for 4- or 8-byte
+ * integers.
+ */
+static size_t keySize(RefBitClockCache* c, const char* key)
+{
+    return c->key_len ? c->key_len : strlen(key) + 1;
+}
+
+static unsigned int hashBytes(const char* key, size_t len)
+{
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static unsigned int hashIntKey(const char* key, size_t len)
+{
+    unsigned int h;
+    if (len == sizeof(uint32_t))
+    {
+        uint32_t k;
+        memcpy(&k, key, sizeof(k));
+        h = k * 2654435769u;
+    }
+    else
+    {
+        uint64_t k;
+        memcpy(&k, key, sizeof(k));
+        h = (unsigned int)((k * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+    // Fold the high bits down for mask-indexed tables; still a bijection on 32-bit keys.
+    return h ^ (h >> 16);
+}
+
+static unsigned int keyHash(RefBitClockCache* c, const char* key)
+{
+    if (c->hash_fn)
+    {
+        return c->hash_fn(key, c->key_len ? c->key_len : strlen(key));
+    }
+    if (c->int_keys)
+    {
+        return hashIntKey(key, c->key_len);
+    }
+    return c->key_len ? hashBytes(key, c->key_len) : hashKey(key);
+}
+
+// Only called for entries whose hash already matched.
+static int keysEqual(RefBitClockCache* c, const char* a, const char* b)
+{
+    if (c->key_equal)
+    {
+        return c->key_equal(a, b, c->key_len ? c->key_len : strlen(a));
+    }
+    if (c->int_keys && c->key_len == sizeof(uint32_t) && !c->hash_fn)
+    {
+        // The built-in hash is a bijection on 32-bit keys, so equal hashes mean equal keys.
+        return 1;
+    }
+    return c->key_len ? memcmp(a, b, c->key_len) == 0 : strcmp(a, b) == 0;
+}
+
+unsigned int hashCacheKey(RefBitClockCache* cache, const char* key)
+{
+    return keyHash(cache, key);
+}
+
+// Bytes a value counts against max_bytes: its data and its key.
+static size_t valueCharge(RefBitClockCache* cache, CacheValue* cv)
+{
+    return cv->size + keySize(cache, valueKey(cv));
+}
+
+/*
+ * Pinned slots
+ *
+ * cache->pinned counts published values with refcount > 0, so a miss can tell
+ * in O(1) that every slot is held. Every 0 -> 1 transition adds one. A 1 -> 0
+ * transition subtracts one unless the value was already detached and this
+ * release claims it: detachSlot() subtracts for a value it cannot claim, and
+ * newly created values are only counted once publishValue() stores them.
+ */
+static void pinValue(RefBitClockCache* c)
+{
+    __atomic_add_fetch(&c->pinned, 1, __ATOMIC_RELAXED);
+}
+
+static void unpinValue(RefBitClockCache* c)
+{
+    __atomic_sub_fetch(&c->pinned, 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&c->victim_waiters, __ATOMIC_RELAXED) > 0)
+    {
+        xSemaphoreGive(c->victim_sem);
+    }
+}
+
+static int holdValue(RefBitClockCache* cache, CacheValue* cv)
+{
+    int ref = __atomic_load_n(&cv->refcount, __ATOMIC_RELAXED);
+    while (ref >= 0)
+    {
+        if (__atomic_compare_exchange_n(&cv->refcount, &ref, ref + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            if (ref == 0)
             {
-                prime = 0;
-                break;
+                pinValue(cache);
             }
+            return 1;
         }
-        if (prime)
+    }
+    return 0;
+}
+
+static int claimValue(CacheValue* cv)
+{
+    int expected = 0;
+    return __atomic_compare_exchange_n(&cv->refcount, &expected, REFCOUNT_DEAD, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static int initPool(CachePool* pool, const RefBitClockCacheConfig* config)
+{
+    memset(pool, 0, sizeof(CachePool));
+    portMUX_INITIALIZE(&pool->lock);
+    if (!config->use_pool)
+    {
+        return 1;
+    }
+
+    size_t align = sizeof(void*);
+    pool->stride = (sizeof(CacheValue) + config->max_key_len + 1 + align - 1) / align * align;
+    pool->count = config->cache_size + (config->pool_spare > 0 ? config->pool_spare : 0);
+    pool->slab = (unsigned char*)capsAlloc(config->meta_caps, pool->count * pool->stride);
+    if (!pool->slab)
+    {
+        return 0;
+    }
+
+    pool->value_slot_size = (config->value_slot_size + align - 1) / align * align;
+    if (pool->value_slot_size)
+    {
+        pool->value_slots = (unsigned char*)capsAlloc(config->value_caps, pool->count * pool->value_slot_size);
+        if (!pool->value_slots)
         {
-            return n;
+            free(pool->slab);
+            pool->slab = NULL;
+            return 0;
         }
-        n++;
     }
-}
 
-unsigned int hash(const char* key, int hash_size)
-{
-    unsigned int h = 2166136261u;
-    while (*key)
+    for (int i = pool->count - 1; i >= 0; i--)
+    {
+        CacheValue* cv = (CacheValue*)(pool->slab + i * pool->stride);
+        cv->retired_next = pool->free_list;
+        pool->free_list = cv;
+    }
+    return 1;
+}
+
+static void freePool(CachePool* pool)
+{
+    free(pool->slab);
+    free(pool->value_slots);
+}
+
+static int inPool(CachePool* pool, CacheValue* cv)
+{
+    return pool->slab && (unsigned char*)cv >= pool->slab &&
+           (unsigned char*)cv < pool->slab + pool->count * pool->stride;
+}
+
+static int inValueSlot(CachePool* pool, void* data)
+{
+    return pool->value_slots && (unsigned char*)data >= pool->value_slots &&
+           (unsigned char*)data < pool->value_slots + pool->count * pool->value_slot_size;
+}
+
+/*
+ * Heap CacheValues for values of up to inline_value_size bytes get room for
+ * the value after the key, so a hit reads key and value from one block. The
+ * room is reserved whatever the value's origin, so data points into it exactly
+ * when the value is stored there.
+ */
+static size_t inlineOffset(size_t key_size)
+{
+    size_t align = sizeof(void*);
+    return (sizeof(CacheValue) + key_size + align - 1) / align * align;
+}
+
+static int hasInlineRoom(RefBitClockCache* cache, CacheValue* cv, size_t value_size)
+{
+    return cache->inline_value_size && value_size <= cache->inline_value_size && !inPool(&cache->pool, cv);
+}
+
+static int valueInline(RefBitClockCache* cache, CacheValue* cv)
+{
+    return hasInlineRoom(cache, cv, cv->size) &&
+           (unsigned char*)cv->data == (unsigned char*)cv + inlineOffset(keySize(cache, valueKey(cv)));
+}
+
+static CacheValue* allocCacheValueMemory(RefBitClockCache* cache, size_t key_size, size_t value_size)
+{
+    CachePool* pool = &cache->pool;
+    CacheValue* cv = NULL;
+
+    if (pool->slab && sizeof(CacheValue) + key_size <= pool->stride)
+    {
+        portENTER_CRITICAL(&pool->lock);
+        cv = pool->free_list;
+        if (cv)
+        {
+            pool->free_list = cv->retired_next;
+        }
+        portEXIT_CRITICAL(&pool->lock);
+    }
+
+    if (!cv)
+    {
+        size_t size = sizeof(CacheValue) + key_size;
+        if (cache->inline_value_size && value_size <= cache->inline_value_size)
+        {
+            size = inlineOffset(key_size) + value_size;
+        }
+        cv = (CacheValue*)capsAlloc(cache->meta_caps, size);
+    }
+    return cv;
+}
+
+static void freeCacheValueMemory(RefBitClockCache* cache, CacheValue* cv)
+{
+    CachePool* pool = &cache->pool;
+
+    if (inPool(pool, cv))
+    {
+        portENTER_CRITICAL(&pool->lock);
+        cv->retired_next = pool->free_list;
+        pool->free_list = cv;
+        portEXIT_CRITICAL(&pool->lock);
+    }
+    else
+    {
+        free(cv);
+    }
+}
+
+static void* allocValueData(RefBitClockCache* cache, CacheValue* cv, size_t value_size)
+{
+    CachePool* pool = &cache->pool;
+
+    if (hasInlineRoom(cache, cv, value_size))
+    {
+        return (unsigned char*)cv + inlineOffset(keySize(cache, valueKey(cv)));
+    }
+    if (pool->value_slots && value_size <= pool->value_slot_size && inPool(pool, cv))
+    {
+        size_t slot = ((unsigned char*)cv - pool->slab) / pool->stride;
+        return pool->value_slots + slot * pool->value_slot_size;
+    }
+    return capsAlloc(cache->value_caps, value_size);
+}
+
+static void freeValueData(RefBitClockCache* cache, CacheValue* cv)
+{
+    if (!inValueSlot(&cache->pool, cv->data) && !valueInline(cache, cv))
+    {
+        cache->value_free(cv->data);
+    }
+    cv->data = NULL;
+}
+
+static void freeWaiting(RefBitClockCache* cache)
+{
+    while (cache->waiting_values)
+    {
+        CacheValue* cv = cache->waiting_values;
+        cache->waiting_values = cv->retired_next;
+        freeCacheValueMemory(cache, cv);
+        cache->retired_count--;
+    }
+
+    while (cache->waiting_tables)
+    {
+        HashTableHeader* hdr = cache->waiting_tables;
+        cache->waiting_tables = hdr->retired_next;
+        free(hdr);
+        cache->retired_count--;
+    }
+}
+
+/*
+ * Must be called with the lock held. Frees the waiting list once the previous
+ * epoch's readers have left, then flips the epoch to start the retired list
+ * waiting. Past cache_size retired entries it waits for those readers instead
+ * of giving up, so the pool cannot drain under steady lock-free traffic.
+ */
+static void reclaimRetired(RefBitClockCache* cache)
+{
+    int blocking = cache->retired_count > cache->cache_size;
+
+    // Flipping while the previous epoch still has readers would let them outlive the waiting list.
+    for (int pass = 0; pass < 2; pass++)
+    {
+        if (blocking)
+        {
+            waitForPreviousEpoch(cache);
+        }
+        else if (!previousEpochDrained(cache))
+        {
+            return;
+        }
+        freeWaiting(cache);
+
+        if (!cache->retired_values && !cache->retired_tables)
+        {
+            return;
+        }
+        cache->waiting_values = cache->retired_values;
+        cache->waiting_tables = cache->retired_tables;
+        cache->retired_values = NULL;
+        cache->retired_tables = NULL;
+        __atomic_add_fetch(&cache->reader_epoch, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Lock-free push; drains detach the whole queue at once, so there is no ABA.
+static void queueFree(RefBitClockCache* cache, CacheValue* cv)
+{
+    CacheValue* head = __atomic_load_n(&cache->free_queue, __ATOMIC_RELAXED);
+    do
+    {
+        cv->retired_next = head;
+    } while (!__atomic_compare_exchange_n(&cache->free_queue, &head, cv, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (!head && cache->free_sem)
+    {
+        xSemaphoreGive(cache->free_sem);
+    }
+}
+
+// Must be called with the lock held, after a successful claimValue().
+static void retireValue(RefBitClockCache* cache, CacheValue* cv)
+{
+    if (cache->free_mode != REFBIT_CACHE_FREE_INLINE)
+    {
+        queueFree(cache, cv);
+        return;
+    }
+    freeValueData(cache, cv);
+    cv->retired_next = cache->retired_values;
+    cache->retired_values = cv;
+    cache->retired_count++;
+    reclaimRetired(cache);
+}
+
+int drainDeferredFrees(RefBitClockCache* cache)
+{
+    if (!__atomic_load_n(&cache->free_queue, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+
+    CacheValue* list = __atomic_exchange_n(&cache->free_queue, NULL, __ATOMIC_ACQUIRE);
+    CacheValue* last = NULL;
+    int n = 0;
+    for (CacheValue* cv = list; cv; cv = cv->retired_next)
+    {
+        freeValueData(cache, cv);
+        last = cv;
+        n++;
+    }
+    if (!list)
+    {
+        return 0;
+    }
+    CACHE_STAT_ADD(cache, queued_frees, n);
+
+    // The entries themselves go through the retired list: lock-free readers may still see them.
+    cache_lock(cache);
+    last->retired_next = cache->retired_values;
+    cache->retired_values = list;
+    cache->retired_count += n;
+    reclaimRetired(cache);
+    cache_unlock(cache);
+    return n;
+}
+
+#define FREE_TASK_RUNNING  1
+#define FREE_TASK_STOPPING 2
+#define FREE_TASK_STOPPED  3
+
+static void freeTask(void* arg)
+{
+    RefBitClockCache* cache = (RefBitClockCache*)arg;
+
+    while (__atomic_load_n(&cache->free_task_state, __ATOMIC_ACQUIRE) == FREE_TASK_RUNNING)
+    {
+        xSemaphoreTake(cache->free_sem, portMAX_DELAY);
+        drainDeferredFrees(cache);
+    }
+    __atomic_store_n(&cache->free_task_state, FREE_TASK_STOPPED, __ATOMIC_RELEASE);
+    vTaskDelete(NULL);
+}
+
+// Must be called with the lock held.
+static void retireHashTable(RefBitClockCache* cache, HashEntry* table)
+{
+    HashTableHeader* hdr = hashTableHeader(table);
+    hdr->retired_next = cache->retired_tables;
+    cache->retired_tables = hdr;
+    cache->retired_count++;
+    reclaimRetired(cache);
+}
+
+unsigned int next_prime(unsigned int n)
+{
+    while (1)
+    {
+        int prime = 1;
+        for (unsigned int i = 2; i * i <= n; i++)
+        {
+            if (n % i == 0)
+            {
+                prime = 0;
+                break;
+            }
+        }
+        if (prime)
+        {
+            return n;
+        }
+        n++;
+    }
+}
+
+unsigned int hashKey(const char* key)
+{
+    unsigned int h = 2166136261u;
+    while (*key)
+    {
+        h ^= (unsigned int)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+unsigned int hash(const char* key, int hash_size)
+{
+    return hashKey(key) % hash_size;
+}
+
+/*
+ * The per-slot arrays as one unit, so resizeCache() can build a complete
+ * replacement before it touches the live cache. ref_counts exists only
+ * under GCLOCK.
+ */
+typedef struct
+{
+    char** keys;
+    CacheValue** values;
+    int* free_slots;
+    unsigned int* ref_bits;
+    unsigned char* ref_counts;
+    TickType_t* expiry;
+} SlotArrays;
+
+static void freeSlotArrays(SlotArrays* arrays)
+{
+    free(arrays->keys);
+    free(arrays->values);
+    free(arrays->free_slots);
+    free(arrays->ref_bits);
+    free(arrays->ref_counts);
+    free(arrays->expiry);
+    memset(arrays, 0, sizeof(SlotArrays));
+}
+
+// Allocates zeroed arrays for size slots; the free slot stack is left to the caller.
+static int allocSlotArrays(RefBitClockCache* cache, int size, SlotArrays* arrays)
+{
+    size_t ref_words = (size + REF_BITS_PER_WORD - 1) / REF_BITS_PER_WORD;
+    int gclock = cache->eviction_policy == REFBIT_CACHE_POLICY_GCLOCK;
+
+    arrays->keys = (char**)capsAlloc(cache->meta_caps, size * sizeof(char*));
+    arrays->values = (CacheValue**)capsAlloc(cache->meta_caps, size * sizeof(CacheValue*));
+    arrays->free_slots = (int*)capsAlloc(cache->meta_caps, size * sizeof(int));
+    arrays->ref_bits = (unsigned int*)capsAlloc(cache->meta_caps, ref_words * sizeof(unsigned int));
+    arrays->ref_counts = gclock ? (unsigned char*)capsAlloc(cache->meta_caps, size) : NULL;
+    arrays->expiry = (TickType_t*)capsAlloc(cache->meta_caps, size * sizeof(TickType_t));
+    if (!arrays->keys || !arrays->values || !arrays->free_slots || !arrays->ref_bits ||
+        (gclock && !arrays->ref_counts) || !arrays->expiry)
+    {
+        freeSlotArrays(arrays);
+        return 0;
+    }
+
+    memset(arrays->keys, 0, size * sizeof(char*));
+    memset(arrays->values, 0, size * sizeof(CacheValue*));
+    memset(arrays->ref_bits, 0, ref_words * sizeof(unsigned int));
+    if (arrays->ref_counts)
+    {
+        memset(arrays->ref_counts, 0, size);
+    }
+    memset(arrays->expiry, 0, size * sizeof(TickType_t));
+    return 1;
+}
+
+static void installSlotArrays(RefBitClockCache* cache, const SlotArrays* arrays)
+{
+    cache->cache.keys = arrays->keys;
+    cache->cache.values = arrays->values;
+    cache->free_slots = arrays->free_slots;
+    cache->ref_bits = arrays->ref_bits;
+    cache->ref_counts = arrays->ref_counts;
+    cache->expiry = arrays->expiry;
+}
+
+static void takeSlotArrays(RefBitClockCache* cache, SlotArrays* arrays)
+{
+    arrays->keys = cache->cache.keys;
+    arrays->values = cache->cache.values;
+    arrays->free_slots = cache->free_slots;
+    arrays->ref_bits = cache->ref_bits;
+    arrays->ref_counts = cache->ref_counts;
+    arrays->expiry = cache->expiry;
+}
+
+// An empty hash table for slots entries, sized to stay at or below half full.
+static HashEntry* allocSlotHashTable(RefBitClockCache* cache, int slots, int* size)
+{
+    if (cache->fixed_hash)
+    {
+        *size = 1;
+        while (*size < slots * 2)
+        {
+            *size <<= 1;
+        }
+        return allocHashTable(*size, *size - 1, cache->meta_caps);
+    }
+
+    *size = next_prime(slots * 2);
+    return allocHashTable(*size, 0, cache->meta_caps);
+}
+
+RefBitClockCache* createCacheWithConfig(const RefBitClockCacheConfig* config)
+{
+    int cache_size = config->cache_size;
+    int int_key_ok = !config->int_keys || config->key_len == sizeof(uint32_t) || config->key_len == sizeof(uint64_t);
+    // Front entries pin their values, so they may hold at most half the slots.
+    unsigned int front_entries = config->front_entries > 0 ? 1 : 0;
+    while (front_entries && front_entries < (unsigned int)config->front_entries)
+    {
+        front_entries <<= 1;
+    }
+    int front_fits = cache_size > 0 && front_entries * portNUM_PROCESSORS <= (unsigned int)cache_size / 2;
+    unsigned int negative_entries = config->negative_entries > 0 ? 1 : 0;
+    while (negative_entries && negative_entries < (unsigned int)config->negative_entries)
+    {
+        negative_entries <<= 1;
+    }
+    if (cache_size <= 0 || !config->value_free || !int_key_ok || !front_fits)
+    {
+        ESP_LOGE(CACHE_TAG, "Invalid cache configuration (size=%d)", cache_size);
+        return NULL;
+    }
+
+    RefBitClockCache* cache = (RefBitClockCache*)capsAlloc(config->meta_caps, sizeof(RefBitClockCache));
+    if (!cache)
+    {
+        ESP_LOGE(CACHE_TAG, "Failed to allocate cache");
+        return NULL;
+    }
+
+    cache->cache_size = cache_size;
+    cache->meta_caps = config->meta_caps;
+    cache->key_len = config->key_len;
+    cache->hash_fn = config->hash_fn;
+    cache->key_equal = config->key_equal;
+    cache->int_keys = config->int_keys;
+    cache->value_caps = config->value_caps;
+    cache->inline_value_size = config->inline_value_size;
+    cache->eviction_policy = config->eviction_policy;
+    cache->gclock_max = config->gclock_max < 1 ? 1 : config->gclock_max > 255 ? 255 : config->gclock_max;
+    SlotArrays arrays;
+    int arrays_ok = allocSlotArrays(cache, cache_size, &arrays);
+    installSlotArrays(cache, &arrays);
+    if (arrays_ok)
+    {
+        for (int i = 0; i < cache_size; i++)
+        {
+            cache->free_slots[i] = cache_size - 1 - i;
+        }
+    }
+    cache->free_count = cache_size;
+    cache->clock_hand = 0;
+    cache->ttl_entries = 0;
+    cache->default_ttl = ttlTicks(config->default_ttl_ms);
+    cache->max_bytes = config->max_bytes;
+    cache->max_value_bytes = config->max_value_bytes;
+    cache->bytes_used = 0;
+    cache->pinned = 0;
+    cache->free_mode = config->free_mode;
+    cache->free_queue = NULL;
+    cache->free_sem = NULL;
+    cache->free_task = NULL;
+    cache->free_task_state = 0;
+    if (cache->free_mode == REFBIT_CACHE_FREE_TASK)
+    {
+        cache->free_sem = xSemaphoreCreateBinary();
+    }
+    cache->front = NULL;
+    cache->front_mask = 0;
+    cache->front_generation = 0;
+    if (front_entries)
+    {
+        size_t front_size = portNUM_PROCESSORS * front_entries * sizeof(CacheFrontSlot);
+        cache->front = (CacheFrontSlot*)capsAlloc(cache->meta_caps, front_size);
+        if (cache->front)
+        {
+            memset(cache->front, 0, front_size);
+        }
+        cache->front_mask = front_entries - 1;
+    }
+    cache->negative = NULL;
+    cache->negative_mask = 0;
+    cache->negative_ttl = ttlTicks(config->negative_ttl_ms);
+    portMUX_INITIALIZE(&cache->negative_lock);
+    if (negative_entries)
+    {
+        size_t negative_size = negative_entries * sizeof(CacheNegativeEntry);
+        cache->negative = (CacheNegativeEntry*)capsAlloc(cache->meta_caps, negative_size);
+        if (cache->negative)
+        {
+            memset(cache->negative, 0, negative_size);
+        }
+        cache->negative_mask = negative_entries - 1;
+    }
+    cache->no_victim_policy = config->no_victim_policy;
+    cache->victim_wait = pdMS_TO_TICKS(config->victim_wait_ms);
+    cache->victim_sem = NULL;
+    cache->victim_waiters = 0;
+    cache->lock_spin = config->lock_spin;
+    cache->lock_timing = config->lock_timing;
+    cache->lock_acquired = 0;
+    if (cache->no_victim_policy == REFBIT_CACHE_NO_VICTIM_WAIT)
+    {
+        cache->victim_sem = xSemaphoreCreateBinary();
+    }
+    cache->fixed_hash = config->fixed_hash_table;
+    cache->hash_table = allocSlotHashTable(cache, cache_size, &cache->hash_size);
+    cache->hash_used = 0;
+    cache->hash_tombstones = 0;
+    cache->old_hash_table = NULL;
+    cache->old_hash_size = 0;
+    cache->rehash_pos = 0;
+    cache->value_free = config->value_free;
+    cache->evict_hook = config->evict_hook;
+    cache->evict_ctx = config->evict_ctx;
+    cache->seq = 0;
+    cache->readers[0] = 0;
+    cache->readers[1] = 0;
+    cache->reader_epoch = 0;
+    cache->retired_values = NULL;
+    cache->retired_tables = NULL;
+    cache->waiting_values = NULL;
+    cache->waiting_tables = NULL;
+    cache->retired_count = 0;
+    cache->pending_loads = NULL;
+    memset(&cache->counters, 0, sizeof(CacheCounters));
+    int pool_ok = initPool(&cache->pool, config);
+
+    cache->lock = xSemaphoreCreateMutex();
+    int victim_sem_ok = cache->no_victim_policy != REFBIT_CACHE_NO_VICTIM_WAIT || cache->victim_sem;
+    int free_sem_ok = cache->free_mode != REFBIT_CACHE_FREE_TASK || cache->free_sem;
+    int front_ok = !front_entries || cache->front;
+    int negative_ok = !negative_entries || cache->negative;
+    if (!cache->lock || !arrays_ok || !cache->hash_table || !pool_ok || !victim_sem_ok || !free_sem_ok || !front_ok ||
+        !negative_ok)
+    {
+        ESP_LOGE(CACHE_TAG, "Failed to allocate cache resources");
+        takeSlotArrays(cache, &arrays);
+        freeSlotArrays(&arrays);
+        if (cache->victim_sem)
+        {
+            vSemaphoreDelete(cache->victim_sem);
+        }
+        if (cache->free_sem)
+        {
+            vSemaphoreDelete(cache->free_sem);
+        }
+        free(cache->front);
+        free(cache->negative);
+        freeHashTable(cache->hash_table);
+        freePool(&cache->pool);
+        if (cache->lock)
+        {
+            vSemaphoreDelete(cache->lock);
+        }
+        free(cache);
+        return NULL;
+    }
+
+    if (cache->free_mode == REFBIT_CACHE_FREE_TASK)
+    {
+        cache->free_task_state = FREE_TASK_RUNNING;
+        if (xTaskCreate(freeTask, "cache_free", config->free_task_stack, cache, config->free_task_priority,
+                        &cache->free_task) != pdPASS)
+        {
+            ESP_LOGE(CACHE_TAG, "Failed to start the cleanup task");
+            cache->free_task = NULL;
+            freeCache(cache);
+            return NULL;
+        }
+    }
+
+    return cache;
+}
+
+RefBitClockCache* createCache(int cache_size, void (*value_free)(void*))
+{
+    RefBitClockCacheConfig config = REFBIT_CACHE_DEFAULT_CONFIG();
+    config.cache_size = cache_size;
+    config.value_free = value_free;
+    return createCacheWithConfig(&config);
+}
+
+static void printCacheStateLocked(RefBitClockCache* cache)
+{
+    char state[256] = {0};
+    int offset = 0;
+    for (int i = 0; i < cache->cache_size && offset < (int)sizeof(state); i++)
+    {
+        if (cache->cache.keys[i])
+        {
+            CacheValue* cv = cache->cache.values[i];
+            offset += snprintf(state + offset, sizeof(state) - offset, "[%d: %.*s, ref=%d, bit=%d] ",
+                               i, KEY_ARGS(cache, cache->cache.keys[i]),
+                               cv ? cv->refcount : 0,
+                               slotHeat(cache, i));
+        }
+    }
+    ESP_LOGI(CACHE_TAG, "Cache state (hand=%d): %s", cache->clock_hand, state);
+}
+
+void printCacheState(RefBitClockCache* cache)
+{
+    cache_lock(cache);
+    printCacheStateLocked(cache);
+    cache_unlock(cache);
+}
+
+// CLOCK: one pass clears reference bits, so two passes always find an unpinned slot.
+static int sweepRefBits(RefBitClockCache* cache, int* attempts_out)
+{
+    int attempts = 0;
+    int max_attempts = cache->cache_size * 2;
+
+    while (attempts < max_attempts)
+    {
+        int word = cache->clock_hand / REF_BITS_PER_WORD;
+        int first = cache->clock_hand % REF_BITS_PER_WORD;
+        int span = cache->cache_size - word * REF_BITS_PER_WORD;
+        if (span > REF_BITS_PER_WORD)
+        {
+            span = REF_BITS_PER_WORD;
+        }
+
+        // Slots from the hand to the end of this word, and which of them were referenced.
+        unsigned int window = (span == REF_BITS_PER_WORD ? ~0u : (1u << span) - 1) & ~((1u << first) - 1);
+        unsigned int refs = __atomic_load_n(&cache->ref_bits[word], __ATOMIC_RELAXED) & window;
+        unsigned int candidates = ~refs & window;
+
+        // Expired slots are victims whatever their reference bit.
+        if (cache->ttl_entries > 0)
+        {
+            TickType_t now = xTaskGetTickCount();
+            for (int b = first; b < span; b++)
+            {
+                if (deadlinePassed(cache->expiry[word * REF_BITS_PER_WORD + b], now))
+                {
+                    candidates |= 1u << b;
+                }
+            }
+        }
+
+        if (!candidates)
+        {
+            __atomic_fetch_and(&cache->ref_bits[word], ~refs, __ATOMIC_RELAXED);
+            attempts += span - first;
+            cache->clock_hand = (word * REF_BITS_PER_WORD + span) % cache->cache_size;
+            continue;
+        }
+
+        // Clear the bits the hand passes on its way to the first unreferenced slot.
+        int bit = __builtin_ctz(candidates);
+        unsigned int passed = refs & ((1u << bit) - 1);
+        if (passed)
+        {
+            __atomic_fetch_and(&cache->ref_bits[word], ~passed, __ATOMIC_RELAXED);
+        }
+        attempts += bit - first + 1;
+
+        int idx = word * REF_BITS_PER_WORD + bit;
+        cache->clock_hand = (idx + 1) % cache->cache_size;
+
+        CacheValue* cv = cache->cache.values[idx];
+        if (cv && __atomic_load_n(&cv->refcount, __ATOMIC_RELAXED) == 0)
+        {
+            *attempts_out = attempts;
+            return idx;
+        }
+    }
+
+    *attempts_out = attempts;
+    return -1;
+}
+
+/*
+ * GCLOCK: hits raise a per-slot counter up to gclock_max and the hand
+ * decrements it, so a slot survives one revolution per recorded hit and a
+ * scan of keys touched once cannot flush frequently used ones.
+ */
+static int sweepGClock(RefBitClockCache* cache, int* attempts_out)
+{
+    int attempts = 0;
+    int max_attempts = cache->cache_size * (cache->gclock_max + 1);
+    TickType_t now = xTaskGetTickCount();
+
+    while (attempts < max_attempts)
+    {
+        int idx = cache->clock_hand;
+        cache->clock_hand = (idx + 1) % cache->cache_size;
+        attempts++;
+
+        CacheValue* cv = cache->cache.values[idx];
+        if (!cv)
+        {
+            continue;
+        }
+
+        unsigned char count = __atomic_load_n(&cache->ref_counts[idx], __ATOMIC_RELAXED);
+        if (count == 0 || deadlinePassed(cache->expiry[idx], now))
+        {
+            if (__atomic_load_n(&cv->refcount, __ATOMIC_RELAXED) == 0)
+            {
+                *attempts_out = attempts;
+                return idx;
+            }
+            continue;
+        }
+
+        __atomic_store_n(&cache->ref_counts[idx], count - 1, __ATOMIC_RELAXED);
+    }
+
+    *attempts_out = attempts;
+    return -1;
+}
+
+/*
+ * Runs the eviction policy over occupied slots. Returns -1 without sweeping
+ * when every value is pinned, and also if the sweep is outrun by concurrent hits.
+ */
+static int sweepClock(RefBitClockCache* cache)
+{
+    if (__atomic_load_n(&cache->pinned, __ATOMIC_RELAXED) >= cache->cache_size - cache->free_count)
+    {
+        CACHE_STAT_INC(cache, no_victim);
+        return -1;
+    }
+
+    int attempts = 0;
+    int idx = cache->eviction_policy == REFBIT_CACHE_POLICY_GCLOCK ? sweepGClock(cache, &attempts)
+                                                                   : sweepRefBits(cache, &attempts);
+    recordSweep(cache, attempts);
+    if (idx == -1)
+    {
+        CACHE_STAT_INC(cache, no_victim);
+    }
+    return idx;
+}
+
+// Returns a free slot if there is one, otherwise a clock victim or -1.
+static int findClockVictim(RefBitClockCache* cache)
+{
+    if (cache->free_count > 0)
+    {
+        return cache->free_slots[--cache->free_count];
+    }
+    return sweepClock(cache);
+}
+
+/*
+ * Incremental rehash
+ *
+ * rehash() only allocates the new table and makes it current; the old table
+ * stays in old_hash_table and every later insert or erase migrates
+ * REFBIT_CACHE_REHASH_STEP of its buckets. Lookups consult the current table
+ * first and then the old one, so no single call pays for moving every entry.
+ * Tombstones count towards the load factor and are dropped by the migration,
+ * so a table that is mostly tombstones is rebuilt at the same size.
+ */
+static int findEntry(RefBitClockCache* cache, HashEntry* table, const char* key, unsigned int hash, int* probe_count)
+{
+    int size = hashTableHeader(table)->size;
+    unsigned int h = homeBucket(table, hash);
+    int probes = 0;
+    int found = -1;
+
+    while (probes < size && table[h].state != STATE_EMPTY)
+    {
+        probes++;
+        if (table[h].state == STATE_OCCUPIED && table[h].hash == hash && keysEqual(cache, table[h].key, key))
+        {
+            found = h;
+            break;
+        }
+
+        h = nextBucket(table, h);
+    }
+
+    if (probe_count)
+    {
+        *probe_count += probes;
+    }
+    return found;
+}
+
+// Must be called with the lock held and inside beginWrite()/endWrite().
+static void rehashStep(RefBitClockCache* cache, int buckets)
+{
+    HashEntry* old_table = cache->old_hash_table;
+    if (!old_table)
+    {
+        return;
+    }
+
+    while (buckets-- > 0 && cache->rehash_pos < cache->old_hash_size)
+    {
+        HashEntry* entry = &old_table[cache->rehash_pos++];
+        if (entry->state == STATE_OCCUPIED)
+        {
+            unsigned int h = homeBucket(cache->hash_table, entry->hash);
+            while (cache->hash_table[h].state == STATE_OCCUPIED)
+            {
+                h = nextBucket(cache->hash_table, h);
+            }
+            if (cache->hash_table[h].state == STATE_TOMBSTONE)
+            {
+                cache->hash_tombstones--;
+            }
+            cache->hash_table[h] = *entry;
+            cache->hash_used++;
+            entry->state = STATE_TOMBSTONE;
+        }
+    }
+
+    if (cache->rehash_pos >= cache->old_hash_size)
+    {
+        __atomic_store_n(&cache->old_hash_table, NULL, __ATOMIC_RELEASE);
+        cache->old_hash_size = 0;
+        retireHashTable(cache, old_table);
+    }
+}
+
+void rehash(RefBitClockCache* cache)
+{
+    // Grow only when live entries need it; otherwise this just sheds tombstones.
+    int new_size = cache->hash_size;
+    if ((cache->hash_used * 10) / cache->hash_size >= 5)
+    {
+        new_size = next_prime(cache->hash_size * 2);
+    }
+
+    HashEntry* new_table = allocHashTable(new_size, 0, cache->meta_caps);
+    if (!new_table)
+    {
+        ESP_LOGE(CACHE_TAG, "Failed to allocate new hash table");
+        return;
+    }
+
+    // Lock-free readers load hash_table before old_hash_table and take the sizes from the table headers.
+    cache->old_hash_size = cache->hash_size;
+    cache->rehash_pos = 0;
+    __atomic_store_n(&cache->old_hash_table, cache->hash_table, __ATOMIC_RELEASE);
+    __atomic_store_n(&cache->hash_table, new_table, __ATOMIC_RELEASE);
+    cache->hash_size = new_size;
+    cache->hash_used = 0;
+    cache->hash_tombstones = 0;
+    CACHE_STAT_INC(cache, rehashes);
+}
+
+void insertHash(RefBitClockCache* cache, char* key, unsigned int hash, int idx)
+{
+    rehashStep(cache, REFBIT_CACHE_REHASH_STEP);
+
+    if (!cache->fixed_hash && ((cache->hash_used + cache->hash_tombstones) * 10) / cache->hash_size >= 7)
+    {
+        // The current table filled up before the previous migration finished.
+        rehashStep(cache, cache->old_hash_size);
+        rehash(cache);
+    }
+
+    unsigned int h = homeBucket(cache->hash_table, hash);
+    int tombstone_idx = -1;
+
+    while (1)
+    {
+        if (cache->hash_table[h].state == STATE_EMPTY)
+        {
+            if (tombstone_idx != -1)
+            {
+                h = tombstone_idx;
+                cache->hash_tombstones--;
+            }
+
+            cache->hash_table[h].key = key;
+            cache->hash_table[h].hash = hash;
+            cache->hash_table[h].cache_index = idx;
+            cache->hash_table[h].state = STATE_OCCUPIED;
+            cache->hash_used++;
+            return;
+        }
+        else if (cache->hash_table[h].state == STATE_TOMBSTONE)
+        {
+            if (tombstone_idx == -1)
+            {
+                tombstone_idx = h;
+            }
+        }
+        else if (cache->hash_table[h].state == STATE_OCCUPIED && cache->hash_table[h].hash == hash &&
+                 keysEqual(cache, cache->hash_table[h].key, key))
+        {
+            cache->hash_table[h].cache_index = idx;
+            return;
+        }
+
+        h = nextBucket(cache->hash_table, h);
+    }
+}
+
+/*
+ * Backward-shift deletion for fixed tables: instead of leaving a tombstone,
+ * pull later entries of the probe run into the hole whenever their home
+ * bucket allows it, so probe lengths do not grow with the number of erases.
+ */
+static void shiftBackward(HashEntry* table, unsigned int hole)
+{
+    unsigned int j = hole;
+
+    while (1)
+    {
+        j = nextBucket(table, j);
+        if (table[j].state != STATE_OCCUPIED)
+        {
+            break;
+        }
+
+        unsigned int home = homeBucket(table, table[j].hash);
+        int stays = hole <= j ? (home > hole && home <= j) : (home > hole || home <= j);
+        if (!stays)
+        {
+            table[hole] = table[j];
+            hole = j;
+        }
+    }
+
+    table[hole].state = STATE_EMPTY;
+    table[hole].key = NULL;
+}
+
+void eraseHash(RefBitClockCache* cache, const char* key, unsigned int hash)
+{
+    int h = findEntry(cache, cache->hash_table, key, hash, NULL);
+
+    if (h != -1 && cache->fixed_hash)
+    {
+        shiftBackward(cache->hash_table, h);
+        cache->hash_used--;
+    }
+    else if (h != -1)
+    {
+        cache->hash_table[h].state = STATE_TOMBSTONE;
+        cache->hash_used--;
+        cache->hash_tombstones++;
+    }
+    else if (cache->old_hash_table)
+    {
+        h = findEntry(cache, cache->old_hash_table, key, hash, NULL);
+        if (h != -1)
+        {
+            cache->old_hash_table[h].state = STATE_TOMBSTONE;
+        }
+    }
+
+    rehashStep(cache, REFBIT_CACHE_REHASH_STEP);
+}
+
+static int findCacheIndex(RefBitClockCache* cache, const char* key, unsigned int hash)
+{
+    int probes = 0;
+    int index = -1;
+    int h = findEntry(cache, cache->hash_table, key, hash, &probes);
+
+    if (h != -1)
+    {
+        index = cache->hash_table[h].cache_index;
+    }
+    else if (cache->old_hash_table)
+    {
+        h = findEntry(cache, cache->old_hash_table, key, hash, &probes);
+        if (h != -1)
+        {
+            index = cache->old_hash_table[h].cache_index;
+        }
+    }
+
+    recordProbe(cache, probes);
+    return index;
+}
+
+int getCacheIndex(RefBitClockCache* cache, const char* key)
+{
+    return findCacheIndex(cache, key, keyHash(cache, key));
+}
+
+#define LOOKUP_MISS  0
+#define LOOKUP_HIT   1
+#define LOOKUP_RETRY 2
+
+/*
+ * Probes one table with relaxed loads. Returns 1 and the slot index if the
+ * key was found, 0 if the probe reached an empty bucket.
+ */
+static int probeLockFree(RefBitClockCache* cache, HashEntry* table, const char* key, unsigned int hash, int* index, int* probe_count)
+{
+    int size = hashTableHeader(table)->size;
+    unsigned int h = homeBucket(table, hash);
+
+    for (int probes = 0; probes < size; probes++)
+    {
+        int state = __atomic_load_n(&table[h].state, __ATOMIC_RELAXED);
+        if (state == STATE_EMPTY)
+        {
+            break;
+        }
+        (*probe_count)++;
+
+        if (state != STATE_OCCUPIED || __atomic_load_n(&table[h].hash, __ATOMIC_RELAXED) != hash)
+        {
+            h = nextBucket(table, h);
+            continue;
+        }
+
+        const char* entry_key = __atomic_load_n(&table[h].key, __ATOMIC_RELAXED);
+        if (entry_key && keysEqual(cache, entry_key, key))
+        {
+            *index = __atomic_load_n(&table[h].cache_index, __ATOMIC_RELAXED);
+            return 1;
+        }
+
+        h = nextBucket(table, h);
+    }
+
+    return 0;
+}
+
+/*
+ * Must be called between enterReader() and exitReader(). A value held when a
+ * writer raced with the probe is returned in stale for the caller to release
+ * after exitReader(): the release may need the lock, and resizeCache() holds
+ * the lock while it waits for readers. If hot is not NULL, it is set on a hit
+ * whose slot was already referenced. Returns LOOKUP_HIT with a held value,
+ * LOOKUP_MISS if the key was definitely absent, or LOOKUP_RETRY if a writer
+ * raced with the probe and the caller has to look again under the lock.
+ */
+static int lookupInReader(RefBitClockCache* cache, const char* key, unsigned int hash, CacheValue** out, CacheValue** stale,
+                          int* hot)
+{
+    int result = LOOKUP_RETRY;
+
+    unsigned int seq = __atomic_load_n(&cache->seq, __ATOMIC_SEQ_CST);
+    if ((seq & 1) == 0)
+    {
+        HashEntry* table = __atomic_load_n(&cache->hash_table, __ATOMIC_ACQUIRE);
+        HashEntry* old_table = __atomic_load_n(&cache->old_hash_table, __ATOMIC_ACQUIRE);
+        CacheValue* cv = NULL;
+        int index = -1;
+        int probes = 0;
+        int matched = probeLockFree(cache, table, key, hash, &index, &probes);
+
+        if (!matched && old_table)
+        {
+            matched = probeLockFree(cache, old_table, key, hash, &index, &probes);
+        }
+
+        if (matched && index >= 0 && index < cache->cache_size)
+        {
+            cv = __atomic_load_n(&cache->cache.values[index], __ATOMIC_RELAXED);
+        }
+
+        // An expired entry is a miss; the clock or the next insert removes it.
+        if (!matched || (cv && valueExpired(cv)))
+        {
+            if (__atomic_load_n(&cache->seq, __ATOMIC_SEQ_CST) == seq)
+            {
+                result = LOOKUP_MISS;
+            }
+        }
+        else if (cv && holdValue(cache, cv))
+        {
+            if (__atomic_load_n(&cache->seq, __ATOMIC_SEQ_CST) == seq)
+            {
+                if (hot)
+                {
+                    *hot = slotHeat(cache, index) > 0;
+                }
+                touchSlot(cache, index);
+                *out = cv;
+                result = LOOKUP_HIT;
+                recordLockFreeHit(cache, probes);
+            }
+            else
+            {
+                *stale = cv;
+            }
+        }
+    }
+
+    return result;
+}
+
+/*
+ * Per-core front cache. A slot belongs to whoever swaps FRONT_BUSY into it,
+ * so a task that migrates to the other core halfway through only costs a
+ * front miss. Entries are held, which keeps their values out of the clock's
+ * reach. detachSlot() drops the entries of a value leaving the cache; one it
+ * cannot reach because its slot is busy goes stale, and such a detach bumps
+ * front_generation.
+ */
+#define FRONT_BUSY ((CacheValue*)1)
+
+static CacheFrontSlot* frontSlot(RefBitClockCache* cache, unsigned int hash)
+{
+    unsigned int i = mixHash(hash) & cache->front_mask;
+    return &cache->front[(unsigned int)xPortGetCoreID() * (cache->front_mask + 1) + i];
+}
+
+static int frontLookup(RefBitClockCache* cache, const char* key, unsigned int hash, CacheValue** out)
+{
+    CacheFrontSlot* slot = frontSlot(cache, hash);
+    CacheValue* cv = __atomic_exchange_n(&slot->cv, FRONT_BUSY, __ATOMIC_ACQUIRE);
+    if (cv == FRONT_BUSY)
+    {
+        return 0;
+    }
+    if (!cv || cv->hash != hash || !keysEqual(cache, valueKey(cv), key))
+    {
+        __atomic_store_n(&slot->cv, cv, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    // Read the generation before index, so a detach after this is caught next time.
+    unsigned int generation = __atomic_load_n(&cache->front_generation, __ATOMIC_SEQ_CST);
+    int live = slot->generation == generation || __atomic_load_n(&cv->index, __ATOMIC_SEQ_CST) != -1;
+    if (!live || valueExpired(cv))
+    {
+        __atomic_store_n(&slot->cv, NULL, __ATOMIC_RELEASE);
+        releaseValue(cache, cv);
+        return 0;
+    }
+    slot->generation = generation;
+
+    // The slot's own reference keeps refcount above zero, so no CAS is needed.
+    __atomic_add_fetch(&cv->refcount, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&slot->cv, cv, __ATOMIC_RELEASE);
+    CACHE_STAT_INC(cache, hits);
+    CACHE_STAT_INC(cache, front_hits);
+    *out = cv;
+    return 1;
+}
+
+// cv is held by the caller and was cached when generation was read.
+static void frontFill(RefBitClockCache* cache, CacheValue* cv, unsigned int generation)
+{
+    CacheFrontSlot* slot = frontSlot(cache, cv->hash);
+    CacheValue* old = __atomic_exchange_n(&slot->cv, FRONT_BUSY, __ATOMIC_ACQUIRE);
+    if (old == FRONT_BUSY)
+    {
+        return;
+    }
+    if (old != cv)
+    {
+        __atomic_add_fetch(&cv->refcount, 1, __ATOMIC_SEQ_CST);
+        slot->generation = generation;
+    }
+    __atomic_store_n(&slot->cv, cv, __ATOMIC_RELEASE);
+    if (old && old != cv)
+    {
+        releaseValue(cache, old);
+    }
+}
+
+// Must be called with the lock held, while cv is still cached.
+static void frontDrop(RefBitClockCache* cache, CacheValue* cv)
+{
+    unsigned int i = mixHash(cv->hash) & cache->front_mask;
+    for (unsigned int core = 0; core < portNUM_PROCESSORS; core++)
+    {
+        CacheValue* expected = cv;
+        CacheFrontSlot* slot = &cache->front[core * (cache->front_mask + 1) + i];
+        if (__atomic_compare_exchange_n(&slot->cv, &expected, NULL, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) &&
+            __atomic_sub_fetch(&cv->refcount, 1, __ATOMIC_SEQ_CST) == 0)
+        {
+            unpinValue(cache);
+        }
+    }
+}
+
+/*
+ * Negative cache: a direct-mapped table of key hashes known to be missing,
+ * guarded by its own spinlock so a miss can check it without the cache lock.
+ */
+static CacheNegativeEntry* negativeSlot(RefBitClockCache* cache, unsigned int hash)
+{
+    return &cache->negative[mixHash(hash) & cache->negative_mask];
+}
+
+static int negativeLookup(RefBitClockCache* cache, unsigned int hash)
+{
+    if (!cache->negative)
+    {
+        return 0;
+    }
+
+    CacheNegativeEntry* entry = negativeSlot(cache, hash);
+    TickType_t now = xTaskGetTickCount();
+    portENTER_CRITICAL(&cache->negative_lock);
+    int hit = entry->used && entry->hash == hash;
+    if (hit && deadlinePassed(entry->expires, now))
+    {
+        entry->used = 0;
+        hit = 0;
+    }
+    portEXIT_CRITICAL(&cache->negative_lock);
+
+    if (hit)
+    {
+        CACHE_STAT_INC(cache, negative_hits);
+    }
+    return hit;
+}
+
+static void negativeInsert(RefBitClockCache* cache, unsigned int hash)
+{
+    CacheNegativeEntry* entry = negativeSlot(cache, hash);
+    TickType_t expires = deadlineAfter(cache->negative_ttl);
+    portENTER_CRITICAL(&cache->negative_lock);
+    entry->hash = hash;
+    entry->expires = expires;
+    entry->used = 1;
+    portEXIT_CRITICAL(&cache->negative_lock);
+}
+
+static void negativeErase(RefBitClockCache* cache, unsigned int hash)
+{
+    if (!cache->negative)
+    {
+        return;
+    }
+
+    CacheNegativeEntry* entry = negativeSlot(cache, hash);
+    portENTER_CRITICAL(&cache->negative_lock);
+    if (entry->hash == hash)
+    {
+        entry->used = 0;
+    }
+    portEXIT_CRITICAL(&cache->negative_lock);
+}
+
+static void negativeClear(RefBitClockCache* cache)
+{
+    if (!cache->negative)
+    {
+        return;
+    }
+
+    portENTER_CRITICAL(&cache->negative_lock);
+    for (unsigned int i = 0; i <= cache->negative_mask; i++)
+    {
+        cache->negative[i].used = 0;
+    }
+    portEXIT_CRITICAL(&cache->negative_lock);
+}
+
+static int lookupLockFree(RefBitClockCache* cache, const char* key, unsigned int hash, CacheValue** out)
+{
+    CacheValue* stale = NULL;
+    unsigned int generation = 0;
+    int hot = 0;
+
+    if (cache->front)
+    {
+        if (frontLookup(cache, key, hash, out))
+        {
+            return LOOKUP_HIT;
+        }
+        generation = __atomic_load_n(&cache->front_generation, __ATOMIC_SEQ_CST);
+    }
+
+    int epoch = enterReader(cache);
+    int result = lookupInReader(cache, key, hash, out, &stale, cache->front ? &hot : NULL);
+    exitReader(cache, epoch);
+
+    releaseValue(cache, stale);
+    // A second hit on a slot since the hand last passed it earns a front entry.
+    if (result == LOOKUP_HIT && hot)
+    {
+        frontFill(cache, *out, generation);
+    }
+    return result;
+}
+
+// Must be called with the lock held.
+static CacheValue* holdLocked(RefBitClockCache* cache, const char* key, unsigned int hash)
+{
+    int index = findCacheIndex(cache, key, hash);
+
+    if (index == -1)
+    {
+        return NULL;
+    }
+
+    CacheValue* cv = cache->cache.values[index];
+
+    if (cv && valueExpired(cv))
+    {
+        return NULL;
+    }
+
+    if (cv)
+    {
+        if (__atomic_add_fetch(&cv->refcount, 1, __ATOMIC_SEQ_CST) == 1)
+        {
+            pinValue(cache);
+        }
+        touchSlot(cache, index);
+        CACHE_STAT_INC(cache, hits);
+        CACHE_TRACE("Cache hit → key: %.*s in line %d ref=%d, bit=%d", KEY_ARGS(cache, key), index, cv->refcount, slotHeat(cache, index));
+        CACHE_TRACE_STATE(cache);
+    }
+    return cv;
+}
+
+/*
+ * Must be called with the lock held and inside beginWrite()/endWrite().
+ * evict marks a clock eviction: an unreferenced, unexpired value is then
+ * offered to evict_hook before it is freed.
+ */
+static void detachSlot(RefBitClockCache* cache, int idx, int evict)
+{
+    if (cache->cache.keys[idx])
+    {
+        eraseHash(cache, cache->cache.keys[idx], cache->cache.values[idx]->hash);
+        cache->cache.keys[idx] = NULL;
+    }
+
+    CacheValue* old = cache->cache.values[idx];
+
+    if (old)
+    {
+        int expired = 0;
+        if (cache->expiry[idx])
+        {
+            expired = deadlinePassed(cache->expiry[idx], xTaskGetTickCount());
+            if (expired)
+            {
+                CACHE_STAT_INC(cache, expirations);
+            }
+            cache->expiry[idx] = 0;
+            cache->ttl_entries--;
+        }
+        cache->bytes_used -= valueCharge(cache, old);
+        if (cache->front)
+        {
+            frontDrop(cache, old);
+        }
+        __atomic_store_n(&old->index, -1, __ATOMIC_SEQ_CST);
+        if (claimValue(old))
+        {
+            if (evict && !expired && cache->evict_hook)
+            {
+                cache->evict_hook(valueKey(old), old->hash, old->data, old->size, cache->evict_ctx);
+            }
+            retireValue(cache, old);
+        }
+        else
+        {
+            __atomic_sub_fetch(&cache->pinned, 1, __ATOMIC_RELAXED);
+            CACHE_STAT_INC(cache, deferred_frees);
+            // Only a held value can still have a front entry, one frontDrop() found busy.
+            if (cache->front)
+            {
+                __atomic_add_fetch(&cache->front_generation, 1, __ATOMIC_SEQ_CST);
+            }
+        }
+        cache->cache.values[idx] = NULL;
+        clearRefBit(cache, idx);
+        if (cache->ref_counts)
+        {
+            cache->ref_counts[idx] = 0;
+        }
+    }
+}
+
+/*
+ * Allocates a held CacheValue for key with no data attached; value_size only
+ * decides whether it gets inline room. It is not visible to other tasks until
+ * publishValue(), so this runs without the lock.
+ */
+static CacheValue* newCacheValue(RefBitClockCache* cache, const char* key, unsigned int hash, size_t value_size)
+{
+    if (cache->free_mode == REFBIT_CACHE_FREE_DEFERRED)
+    {
+        drainDeferredFrees(cache);
+    }
+
+    size_t key_size = keySize(cache, key);
+    CacheValue* cv = allocCacheValueMemory(cache, key_size, value_size);
+    if (!cv)
+    {
+        ESP_LOGE(CACHE_TAG, "Failed to allocate CacheValue");
+        return NULL;
+    }
+    memcpy(valueKey(cv), key, key_size);
+    cv->data = NULL;
+    cv->refcount = 1;
+    cv->index = -1;
+    cv->hash = hash;
+    cv->size = 0;
+    cv->expires = deadlineAfter(cache->default_ttl);
+    cv->retired_next = NULL;
+    return cv;
+}
+
+static CacheValue* newCacheValueWithData(RefBitClockCache* cache, const char* key, unsigned int hash, size_t value_size)
+{
+    CacheValue* cv = newCacheValue(cache, key, hash, value_size);
+    if (!cv)
+    {
+        return NULL;
+    }
+    cv->data = allocValueData(cache, cv, value_size);
+    if (!cv->data)
+    {
+        ESP_LOGE(CACHE_TAG, "Failed to allocate data");
+        freeCacheValueMemory(cache, cv);
+        return NULL;
+    }
+    cv->size = value_size;
+    return cv;
+}
+
+static CacheValue* newCacheValueCopy(RefBitClockCache* cache, const char* key, unsigned int hash, void* value, size_t value_size)
+{
+    CacheValue* cv = newCacheValueWithData(cache, key, hash, value_size);
+    if (cv)
+    {
+        memcpy(cv->data, value, value_size);
+    }
+    return cv;
+}
+
+static void discardCacheValue(RefBitClockCache* cache, CacheValue* cv)
+{
+    freeValueData(cache, cv);
+    freeCacheValueMemory(cache, cv);
+}
+
+/*
+ * Must be called with the lock held. Stores cv in slot index (the slot
+ * currently holding the same key) or, if index is -1, in a clock victim,
+ * then evicts more values while the byte budget is exceeded. Returns 0 if
+ * there was no victim; a replaced entry for the key is then already gone.
+ */
+static int publishValue(RefBitClockCache* cache, CacheValue* cv, int index)
+{
+    reclaimRetired(cache);
+    negativeErase(cache, cv->hash);
+
+    int victim_idx = index;
+    if (victim_idx == -1)
+    {
+        victim_idx = findClockVictim(cache);
+        if (victim_idx == -1)
+        {
+            return 0;
+        }
+        if (cache->cache.values[victim_idx])
+        {
+            CACHE_STAT_INC(cache, evictions);
+        }
+    }
+
+    beginWrite(cache);
+    detachSlot(cache, victim_idx, index == -1);
+
+    size_t charge = valueCharge(cache, cv);
+    while (cache->max_bytes && cache->bytes_used + charge > cache->max_bytes)
+    {
+        int idx = sweepClock(cache);
+        if (idx == -1)
+        {
+            cache->free_slots[cache->free_count++] = victim_idx;
+            endWrite(cache);
+            return 0;
+        }
+        CACHE_STAT_INC(cache, evictions);
+        detachSlot(cache, idx, 1);
+        cache->free_slots[cache->free_count++] = idx;
+    }
+    cache->bytes_used += charge;
+
+    cv->index = victim_idx;
+    cache->cache.keys[victim_idx] = valueKey(cv);
+    cache->cache.values[victim_idx] = cv;
+    if (cache->ref_counts)
+    {
+        cache->ref_counts[victim_idx] = 1;
+    }
+    else
+    {
+        setRefBit(cache, victim_idx);
+    }
+    cache->expiry[victim_idx] = cv->expires;
+    if (cv->expires)
+    {
+        cache->ttl_entries++;
+    }
+
+    insertHash(cache, cache->cache.keys[victim_idx], cv->hash, victim_idx);
+    pinValue(cache);
+    endWrite(cache);
+
+    CACHE_TRACE("Cache miss → stored key: %.*s in line %d ref=1, bit=1 (victim was %d)", KEY_ARGS(cache, valueKey(cv)), victim_idx, victim_idx);
+    CACHE_TRACE_STATE(cache);
+    return 1;
+}
+
+// Must be called with the lock held and inside beginWrite()/endWrite().
+static void invalidateSlot(RefBitClockCache* cache, int idx)
+{
+    detachSlot(cache, idx, 0);
+    cache->free_slots[cache->free_count++] = idx;
+    CACHE_STAT_INC(cache, invalidations);
+    if (__atomic_load_n(&cache->victim_waiters, __ATOMIC_RELAXED) > 0)
+    {
+        xSemaphoreGive(cache->victim_sem);
+    }
+}
+
+static int valueOversized(RefBitClockCache* cache, CacheValue* cv)
+{
+    return (cache->max_value_bytes && cv->size > cache->max_value_bytes) ||
+           (cache->max_bytes && valueCharge(cache, cv) > cache->max_bytes);
+}
+
+/*
+ * Must be called with the lock held. Publishes cv and applies
+ * no_victim_policy if every slot is held: returns cv (uncached under BYPASS)
+ * or NULL after freeing it. WAIT drops the lock while it sleeps.
+ */
+static CacheValue* admitValue(RefBitClockCache* cache, CacheValue* cv, int index)
+{
+    TickType_t start = xTaskGetTickCount();
+
+    if (valueOversized(cache, cv))
+    {
+        CACHE_STAT_INC(cache, oversized);
+        if (cache->no_victim_policy == REFBIT_CACHE_NO_VICTIM_BYPASS)
+        {
+            // The returned value replaces the cached one, even though it is not cached itself.
+            if (index != -1)
+            {
+                reclaimRetired(cache);
+                beginWrite(cache);
+                invalidateSlot(cache, index);
+                endWrite(cache);
+            }
+            negativeErase(cache, cv->hash);
+            return cv;
+        }
+        discardCacheValue(cache, cv);
+        return NULL;
+    }
+
+    while (!publishValue(cache, cv, index))
+    {
+        if (cache->no_victim_policy == REFBIT_CACHE_NO_VICTIM_BYPASS)
+        {
+            return cv;
+        }
+
+        TickType_t waited = xTaskGetTickCount() - start;
+        if (cache->no_victim_policy != REFBIT_CACHE_NO_VICTIM_WAIT || waited >= cache->victim_wait)
+        {
+            ESP_LOGW(CACHE_TAG, "No evictable slot for key: %.*s", KEY_ARGS(cache, valueKey(cv)));
+            discardCacheValue(cache, cv);
+            return NULL;
+        }
+
+        __atomic_add_fetch(&cache->victim_waiters, 1, __ATOMIC_SEQ_CST);
+        cache_unlock(cache);
+        xSemaphoreTake(cache->victim_sem, cache->victim_wait - waited);
+        cache_lock(cache);
+        __atomic_sub_fetch(&cache->victim_waiters, 1, __ATOMIC_SEQ_CST);
+
+        // The key may have been inserted while the lock was dropped.
+        index = findCacheIndex(cache, valueKey(cv), cv->hash);
+    }
+    return cv;
+}
+
+static int lookupCacheWait(RefBitClockCache* cache, const char* key, TickType_t wait, CacheValue** out)
+{
+    CacheValue* cv = NULL;
+    unsigned int hash = keyHash(cache, key);
+    int result = lookupLockFree(cache, key, hash, &cv);
+
+    *out = NULL;
+    if (result == LOOKUP_HIT)
+    {
+        CACHE_TRACE("Cache hit → key: %.*s in line %d ref=%d, bit=%d", KEY_ARGS(cache, key), cv->index, cv->refcount, slotHeat(cache, cv->index));
+        *out = cv;
+        return REFBIT_CACHE_OK;
+    }
+    if (result == LOOKUP_MISS)
+    {
+        CACHE_STAT_INC(cache, misses);
+        return negativeLookup(cache, hash) ? REFBIT_CACHE_MISSING : REFBIT_CACHE_OK;
+    }
+
+    if (!cache_lock_wait(cache, wait))
+    {
+        return REFBIT_CACHE_BUSY;
+    }
+    cv = holdLocked(cache, key, hash);
+    cache_unlock(cache);
+    if (!cv)
+    {
+        CACHE_STAT_INC(cache, misses);
+        return negativeLookup(cache, hash) ? REFBIT_CACHE_MISSING : REFBIT_CACHE_OK;
+    }
+    *out = cv;
+    return REFBIT_CACHE_OK;
+}
+
+CacheValue* lookupCache(RefBitClockCache* cache, const char* key)
+{
+    CacheValue* cv;
+    lookupCacheWait(cache, key, portMAX_DELAY, &cv);
+    return cv;
+}
+
+int lookupCacheTimeout(RefBitClockCache* cache, const char* key, int timeout_ms, CacheValue** out)
+{
+    return lookupCacheWait(cache, key, pdMS_TO_TICKS(timeout_ms), out);
+}
+
+int lookupCacheStatus(RefBitClockCache* cache, const char* key, CacheValue** out)
+{
+    return lookupCacheWait(cache, key, portMAX_DELAY, out);
+}
+
+int markCacheMissing(RefBitClockCache* cache, const char* key)
+{
+    if (!cache->negative)
+    {
+        return 0;
+    }
+
+    unsigned int hash = keyHash(cache, key);
+    cache_lock(cache);
+    int cached = findCacheIndex(cache, key, hash) != -1;
+    if (!cached)
+    {
+        negativeInsert(cache, hash);
+    }
+    cache_unlock(cache);
+    return !cached;
+}
+
+CacheValue* insertCache(RefBitClockCache* cache, const char* key, void* value, size_t value_size)
+{
+    CacheValue* cv = newCacheValueCopy(cache, key, keyHash(cache, key), value, value_size);
+    if (!cv)
+    {
+        return NULL;
+    }
+
+    cache_lock(cache);
+    cv = admitValue(cache, cv, findCacheIndex(cache, key, cv->hash));
+    cache_unlock(cache);
+    return cv;
+}
+
+CacheValue* insertCacheWithTTL(RefBitClockCache* cache, const char* key, void* value, size_t value_size, int ttl_ms)
+{
+    CacheValue* cv = newCacheValueCopy(cache, key, keyHash(cache, key), value, value_size);
+    if (!cv)
+    {
+        return NULL;
+    }
+    cv->expires = deadlineAfter(ttlTicks(ttl_ms));
+
+    cache_lock(cache);
+    cv = admitValue(cache, cv, findCacheIndex(cache, key, cv->hash));
+    cache_unlock(cache);
+    return cv;
+}
+
+CacheValue* insertCacheOwned(RefBitClockCache* cache, const char* key, void* data, size_t value_size)
+{
+    // Small owned buffers stay where they are: value_free may do more than free().
+    CacheValue* cv = newCacheValue(cache, key, keyHash(cache, key), value_size);
+    if (!cv)
+    {
+        cache->value_free(data);
+        return NULL;
+    }
+    cv->data = data;
+    cv->size = value_size;
+
+    cache_lock(cache);
+    cv = admitValue(cache, cv, findCacheIndex(cache, key, cv->hash));
+    cache_unlock(cache);
+    return cv;
+}
+
+CacheValue* reserveCacheValue(RefBitClockCache* cache, const char* key, size_t value_size)
+{
+    return newCacheValueWithData(cache, key, keyHash(cache, key), value_size);
+}
+
+CacheValue* commitCacheValue(RefBitClockCache* cache, CacheValue* cv)
+{
+    cache_lock(cache);
+    cv = admitValue(cache, cv, findCacheIndex(cache, valueKey(cv), cv->hash));
+    cache_unlock(cache);
+    return cv;
+}
+
+void abortCacheValue(RefBitClockCache* cache, CacheValue* cv)
+{
+    if (cv)
+    {
+        discardCacheValue(cache, cv);
+    }
+}
+
+static int accessCacheWait(RefBitClockCache* cache, const char* key, void* value, size_t value_size, TickType_t wait,
+                           CacheValue** out)
+{
+    CacheValue* cv = NULL;
+    unsigned int hash = keyHash(cache, key);
+    if (lookupLockFree(cache, key, hash, &cv) == LOOKUP_HIT)
+    {
+        CACHE_TRACE("Cache hit → key: %.*s in line %d ref=%d, bit=%d", KEY_ARGS(cache, key), cv->index, cv->refcount, slotHeat(cache, cv->index));
+        *out = cv;
+        return REFBIT_CACHE_OK;
+    }
+
+    // Copy the value before taking the lock; a racing insert of the same key is rare.
+    CacheValue* fresh = newCacheValueCopy(cache, key, hash, value, value_size);
+
+    *out = NULL;
+    if (!cache_lock_wait(cache, wait))
+    {
+        if (fresh)
+        {
+            discardCacheValue(cache, fresh);
+        }
+        return REFBIT_CACHE_BUSY;
+    }
+
+    cv = holdLocked(cache, key, hash);
+    if (cv)
+    {
+        cache_unlock(cache);
+        if (fresh)
+        {
+            discardCacheValue(cache, fresh);
+        }
+        *out = cv;
+        return REFBIT_CACHE_OK;
+    }
+
+    CACHE_STAT_INC(cache, misses);
+    if (fresh)
+    {
+        // Replaces an expired entry for the key, if there is one.
+        fresh = admitValue(cache, fresh, findCacheIndex(cache, key, hash));
+    }
+
+    cache_unlock(cache);
+    *out = fresh;
+    return REFBIT_CACHE_OK;
+}
+
+CacheValue* accessCache(RefBitClockCache* cache, const char* key, void* value, size_t value_size)
+{
+    CacheValue* cv;
+    accessCacheWait(cache, key, value, value_size, portMAX_DELAY, &cv);
+    return cv;
+}
+
+int accessCacheTimeout(RefBitClockCache* cache, const char* key, void* value, size_t value_size, int timeout_ms,
+                       CacheValue** out)
+{
+    return accessCacheWait(cache, key, value, value_size, pdMS_TO_TICKS(timeout_ms), out);
+}
+
+int invalidateCache(RefBitClockCache* cache, const char* key)
+{
+    cache_lock(cache);
+
+    unsigned int hash = keyHash(cache, key);
+    int index = findCacheIndex(cache, key, hash);
+    if (index != -1)
+    {
+        reclaimRetired(cache);
+        beginWrite(cache);
+        invalidateSlot(cache, index);
+        endWrite(cache);
+        CACHE_TRACE("Invalidated key: %.*s in line %d", KEY_ARGS(cache, key), index);
+    }
+    negativeErase(cache, hash);
+
+    cache_unlock(cache);
+    return index != -1;
+}
+
+int invalidateIf(RefBitClockCache* cache, CacheKeyPredicate predicate, void* ctx)
+{
+    int removed = 0;
+
+    cache_lock(cache);
+    reclaimRetired(cache);
+    negativeClear(cache);
+    beginWrite(cache);
+
+    for (int i = 0; i < cache->cache_size; i++)
+    {
+        CacheValue* cv = cache->cache.values[i];
+        if (cv && predicate(cache->cache.keys[i], cv->data, ctx))
+        {
+            invalidateSlot(cache, i);
+            removed++;
+        }
+    }
+
+    endWrite(cache);
+    cache_unlock(cache);
+    return removed;
+}
+
+static int keyHasPrefix(const char* key, void* data, void* ctx)
+{
+    (void)data;
+    const char* prefix = (const char*)ctx;
+    return strncmp(key, prefix, strlen(prefix)) == 0;
+}
+
+int invalidatePrefix(RefBitClockCache* cache, const char* prefix)
+{
+    return invalidateIf(cache, keyHasPrefix, (void*)prefix);
+}
+
+// Must be called inside beginWrite()/endWrite(). Copies slot from of the live arrays to slot to of the new ones.
+static void moveSlot(RefBitClockCache* cache, SlotArrays* arrays, int from, int to)
+{
+    CacheValue* cv = cache->cache.values[from];
+
+    arrays->keys[to] = cache->cache.keys[from];
+    arrays->values[to] = cv;
+    arrays->expiry[to] = cache->expiry[from];
+    if (arrays->ref_counts)
+    {
+        arrays->ref_counts[to] = cache->ref_counts[from];
+    }
+    else if (testRefBit(cache, from))
+    {
+        arrays->ref_bits[to / REF_BITS_PER_WORD] |= 1u << (to % REF_BITS_PER_WORD);
+    }
+    __atomic_store_n(&cv->index, to, __ATOMIC_SEQ_CST);
+}
+
+int resizeCache(RefBitClockCache* cache, int new_size)
+{
+    // Front entries are held, so they must keep fitting in half of the cache.
+    unsigned int front_entries = cache->front ? cache->front_mask + 1 : 0;
+    if (new_size <= 0 || front_entries * portNUM_PROCESSORS > (unsigned int)new_size / 2)
+    {
+        ESP_LOGE(CACHE_TAG, "Invalid cache size %d", new_size);
+        return 0;
+    }
+
+    cache_lock(cache);
+    int old_size = cache->cache_size;
+    if (new_size == old_size)
+    {
+        cache_unlock(cache);
+        return 1;
+    }
+
+    // Allocate everything first so a failure leaves the cache as it was.
+    SlotArrays arrays;
+    int table_size = 0;
+    HashEntry* table = NULL;
+    if (allocSlotArrays(cache, new_size, &arrays))
+    {
+        table = allocSlotHashTable(cache, new_size, &table_size);
+        if (!table)
+        {
+            freeSlotArrays(&arrays);
+        }
+    }
+    if (!table)
+    {
+        ESP_LOGE(CACHE_TAG, "Failed to allocate arrays for %d entries", new_size);
+        cache_unlock(cache);
+        return 0;
+    }
+
+    reclaimRetired(cache);
+    beginWrite(cache);
+
+    // Evict in clock order until the survivors fit. When everything left is
+    // held, the highest slots are detached anyway and their holders keep them.
+    while (cache->cache_size - cache->free_count > new_size)
+    {
+        int idx = sweepClock(cache);
+        if (idx == -1)
+        {
+            idx = old_size - 1;
+            while (!cache->cache.values[idx])
+            {
+                idx--;
+            }
+        }
+        CACHE_STAT_INC(cache, evictions);
+        detachSlot(cache, idx, 1);
+        cache->free_slots[cache->free_count++] = idx;
+    }
+
+    waitForReaders(cache);
+
+    // Survivors keep their slot if it still exists; the others fill the holes.
+    int hole = 0;
+    for (int i = 0; i < old_size; i++)
+    {
+        if (!cache->cache.values[i])
+        {
+            continue;
+        }
+        if (i < new_size)
+        {
+            moveSlot(cache, &arrays, i, i);
+            continue;
+        }
+        while (arrays.values[hole])
+        {
+            hole++;
+        }
+        moveSlot(cache, &arrays, i, hole);
+    }
+
+    SlotArrays old_arrays;
+    takeSlotArrays(cache, &old_arrays);
+    installSlotArrays(cache, &arrays);
+    freeSlotArrays(&old_arrays);
+
+    cache->cache_size = new_size;
+    cache->free_count = 0;
+    for (int i = new_size - 1; i >= 0; i--)
+    {
+        if (!cache->cache.values[i])
+        {
+            cache->free_slots[cache->free_count++] = i;
+        }
+    }
+    if (cache->clock_hand >= new_size)
+    {
+        cache->clock_hand = 0;
+    }
+
+    // A batch lookup may still hold the old tables, so they are retired rather than freed.
+    HashEntry* old_table = cache->hash_table;
+    HashEntry* older_table = cache->old_hash_table;
+    __atomic_store_n(&cache->old_hash_table, NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&cache->hash_table, table, __ATOMIC_RELEASE);
+    cache->hash_size = table_size;
+    cache->hash_used = 0;
+    cache->hash_tombstones = 0;
+    cache->old_hash_size = 0;
+    cache->rehash_pos = 0;
+    if (older_table)
+    {
+        retireHashTable(cache, older_table);
+    }
+    retireHashTable(cache, old_table);
+
+    for (int i = 0; i < new_size; i++)
+    {
+        if (cache->cache.values[i])
+        {
+            insertHash(cache, cache->cache.keys[i], cache->cache.values[i]->hash, i);
+        }
+    }
+
+    endWrite(cache);
+
+    if (new_size > old_size && __atomic_load_n(&cache->victim_waiters, __ATOMIC_RELAXED) > 0)
+    {
+        xSemaphoreGive(cache->victim_sem);
+    }
+
+    CACHE_TRACE("Resized cache from %d to %d entries", old_size, new_size);
+    cache_unlock(cache);
+    return 1;
+}
+
+/*
+ * Snapshot format, with every integer little-endian:
+ *   header: u32 magic, u32 version, u32 key_len, u32 entry count
+ *   entry:  u16 key bytes, u32 value bytes, u32 remaining TTL in ms (0 = none), key, value
+ * String keys are stored with their terminating NUL.
+ */
+#define SNAPSHOT_MAGIC       0x53434252u // "RBCS"
+#define SNAPSHOT_VERSION     1
+#define SNAPSHOT_HEADER_SIZE 16
+#define SNAPSHOT_ENTRY_SIZE  10
+#define SNAPSHOT_MAX_KEY     0xffff
+#define RESTORE_BATCH        16
+
+static void putLE(unsigned char* p, uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        p[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static uint32_t getLE(const unsigned char* p, int bytes)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < bytes; i++)
+    {
+        value |= (uint32_t)p[i] << (8 * i);
+    }
+    return value;
+}
+
+/*
+ * Must be called with the lock held. Holds up to room live entries and stores
+ * them in out in clock order from the hand, with their heat levels.
+ */
+static int collectLive(RefBitClockCache* cache, CacheValue** out, unsigned char* heat, int room)
+{
+    int n = 0;
+
+    for (int step = 0; step < cache->cache_size && n < room; step++)
+    {
+        int idx = (cache->clock_hand + step) % cache->cache_size;
+        CacheValue* cv = cache->cache.values[idx];
+        if (!cv || valueExpired(cv) || keySize(cache, valueKey(cv)) > SNAPSHOT_MAX_KEY || !holdValue(cache, cv))
+        {
+            continue;
+        }
+        out[n] = cv;
+        heat[n] = (unsigned char)slotHeat(cache, idx);
+        n++;
+    }
+    return n;
+}
+
+// Counting sort of in into out, highest level first and stable within a level.
+static void sortByHeat(CacheValue** out, CacheValue* const* in, const unsigned char* heat, int n, int* level_count, int levels)
+{
+    memset(level_count, 0, levels * sizeof(int));
+    for (int i = 0; i < n; i++)
+    {
+        level_count[heat[i]]++;
+    }
+
+    // level_count becomes each level's next output position.
+    int pos = 0;
+    for (int level = levels - 1; level >= 0; level--)
+    {
+        int count = level_count[level];
+        level_count[level] = pos;
+        pos += count;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        out[level_count[heat[i]]++] = in[i];
+    }
+}
+
+static int writeSnapshotEntry(RefBitClockCache* cache, CacheValue* cv, CacheSnapshotWriter writer, void* ctx)
+{
+    const char* key = valueKey(cv);
+    size_t key_size = keySize(cache, key);
+    uint32_t ttl_ms = 0;
+
+    if (cv->expires)
+    {
+        // An entry that expired after it was collected is written with the shortest TTL.
+        TickType_t now = xTaskGetTickCount();
+        ttl_ms = deadlinePassed(cv->expires, now) ? 1 : (uint32_t)(cv->expires - now) * portTICK_PERIOD_MS;
+    }
+
+    unsigned char record[SNAPSHOT_ENTRY_SIZE];
+    putLE(record, (uint32_t)key_size, 2);
+    putLE(record + 2, (uint32_t)cv->size, 4);
+    putLE(record + 6, ttl_ms, 4);
+    return writer(record, sizeof(record), ctx) && writer(key, key_size, ctx) && (cv->size == 0 || writer(cv->data, cv->size, ctx));
+}
+
+int snapshotCaches(RefBitClockCache* const caches[], int num_caches, int max_entries, CacheSnapshotWriter writer,
+                   void* ctx)
+{
+    RefBitClockCache* first = caches[0];
+    int levels = (first->ref_counts ? first->gclock_max : 1) + 1;
+    int size = 0;
+    for (int i = 0; i < num_caches; i++)
+    {
+        size += caches[i]->cache_size;
+    }
+
+    CacheValue** held = (CacheValue**)malloc(2 * size * sizeof(CacheValue*));
+    unsigned char* heat = (unsigned char*)malloc(size);
+    int* level_count = (int*)malloc(levels * sizeof(int));
+    int* counts = (int*)malloc(num_caches * sizeof(int));
+    if (!held || !heat || !level_count || !counts)
+    {
+        ESP_LOGE(CACHE_TAG, "Failed to allocate snapshot buffers");
+        free(held);
+        free(heat);
+        free(level_count);
+        free(counts);
+        return -1;
+    }
+
+    // held + size keeps each cache's entries together so they can be released to it.
+    CacheValue** collected = held + size;
+    int n = 0;
+    for (int i = 0; i < num_caches; i++)
+    {
+        cache_lock(caches[i]);
+        counts[i] = collectLive(caches[i], collected + n, heat + n, size - n);
+        cache_unlock(caches[i]);
+        n += counts[i];
+    }
+    sortByHeat(held, collected, heat, n, level_count, levels);
+    free(heat);
+    free(level_count);
+
+    int count = max_entries > 0 && max_entries < n ? max_entries : n;
+    unsigned char header[SNAPSHOT_HEADER_SIZE];
+    putLE(header, SNAPSHOT_MAGIC, 4);
+    putLE(header + 4, SNAPSHOT_VERSION, 4);
+    putLE(header + 8, (uint32_t)first->key_len, 4);
+    putLE(header + 12, (uint32_t)count, 4);
+
+    int ok = writer(header, sizeof(header), ctx);
+    for (int i = 0; ok && i < count; i++)
+    {
+        ok = writeSnapshotEntry(first, held[i], writer, ctx);
+    }
+    if (!ok)
+    {
+        ESP_LOGE(CACHE_TAG, "Snapshot writer failed");
+    }
+
+    for (int i = 0, start = 0; i < num_caches; start += counts[i], i++)
+    {
+        releaseValueBatch(caches[i], collected + start, counts[i]);
+    }
+    free(counts);
+    free(held);
+    return ok ? count : -1;
+}
+
+int snapshotCache(RefBitClockCache* cache, int max_entries, CacheSnapshotWriter writer, void* ctx)
+{
+    return snapshotCaches(&cache, 1, max_entries, writer, ctx);
+}
+
+/*
+ * Reads one entry into a new held CacheValue of the cache its key routes to,
+ * whose index is stored in *target; key is a scratch buffer grown as needed.
+ */
+static CacheValue* readSnapshotEntry(RefBitClockCache* const caches[], int num_caches, CacheSnapshotReader reader,
+                                     void* ctx, char** key, size_t* key_cap, int* target)
+{
+    RefBitClockCache* cache = caches[0];
+    unsigned char record[SNAPSHOT_ENTRY_SIZE];
+    if (!reader(record, sizeof(record), ctx))
+    {
+        return NULL;
+    }
+
+    size_t key_size = getLE(record, 2);
+    size_t value_size = getLE(record + 2, 4);
+    uint32_t ttl_ms = getLE(record + 6, 4);
+    if (key_size == 0)
+    {
+        return NULL;
+    }
+    if (key_size > *key_cap)
+    {
+        char* grown = (char*)realloc(*key, key_size);
+        if (!grown)
+        {
+            return NULL;
+        }
+        *key = grown;
+        *key_cap = key_size;
+    }
+    if (!reader(*key, key_size, ctx) || (!cache->key_len && (*key)[key_size - 1] != '\0') ||
+        keySize(cache, *key) != key_size)
+    {
+        return NULL;
+    }
+
+    unsigned int hash = keyHash(cache, *key);
+    *target = (int)(hash % (unsigned int)num_caches);
+    cache = caches[*target];
+    CacheValue* cv = newCacheValueWithData(cache, *key, hash, value_size);
+    if (!cv)
     {
-        h ^= (unsigned int)*key++;
-        h *= 16777619u;
+        return NULL;
     }
-    return h % hash_size;
+    if (value_size && !reader(cv->data, value_size, ctx))
+    {
+        discardCacheValue(cache, cv);
+        return NULL;
+    }
+    cv->expires = deadlineAfter(ttlTicks(ttl_ms > INT32_MAX ? INT32_MAX : (int)ttl_ms));
+    return cv;
 }
 
-RefBitClockCache* createCache(int cache_size, void (*value_free)(void*))
+// Publishes a batch of restored values under one lock and drops the holds.
+static int restoreBatch(RefBitClockCache* cache, CacheValue* batch[], int n)
 {
-    RefBitClockCache* cache = (RefBitClockCache*)malloc(sizeof(RefBitClockCache));
-    if (!cache)
+    int restored = 0;
+
+    cache_lock(cache);
+    for (int i = 0; i < n; i++)
     {
-        ESP_LOGE(CACHE_TAG, "Failed to allocate cache");
-        return NULL;
+        CacheValue* cv = batch[i];
+
+        // Live entries are newer than the snapshot, and a full cache keeps what it has.
+        int full = cache->free_count == 0 ||
+                   (cache->max_bytes && cache->bytes_used + valueCharge(cache, cv) > cache->max_bytes);
+        if (full || valueOversized(cache, cv) || findCacheIndex(cache, valueKey(cv), cv->hash) != -1 ||
+            !publishValue(cache, cv, -1))
+        {
+            discardCacheValue(cache, cv);
+            batch[i] = NULL;
+            continue;
+        }
+        restored++;
     }
+    cache_unlock(cache);
 
-    cache->cache_size = cache_size;
-    cache->cache.keys = (char**)malloc(cache_size * sizeof(char*));
-    if (cache->cache.keys)
+    releaseValueBatch(cache, batch, n);
+    return restored;
+}
+
+int restoreCaches(RefBitClockCache* const caches[], int num_caches, CacheSnapshotReader reader, void* ctx)
+{
+    unsigned char header[SNAPSHOT_HEADER_SIZE];
+    if (!reader(header, sizeof(header), ctx) || getLE(header, 4) != SNAPSHOT_MAGIC ||
+        getLE(header + 4, 4) != SNAPSHOT_VERSION || getLE(header + 8, 4) != caches[0]->key_len)
     {
-        memset(cache->cache.keys, 0, cache_size * sizeof(char*));
+        ESP_LOGE(CACHE_TAG, "Invalid cache snapshot header");
+        return -1;
     }
-    cache->cache.values = (CacheValue**)malloc(cache_size * sizeof(CacheValue*));
-    if (cache->cache.values)
+
+    uint32_t count = getLE(header + 12, 4);
+    CacheValue* batch[RESTORE_BATCH];
+    char* key = NULL;
+    size_t key_cap = 0;
+    int restored = 0;
+    int n = 0;
+    int batch_target = 0;
+    int ok = 1;
+
+    // A batch holds consecutive entries for one cache.
+    for (uint32_t done = 0; done < count; done++)
     {
-        memset(cache->cache.values, 0, cache_size * sizeof(CacheValue*));
+        int target;
+        CacheValue* cv = readSnapshotEntry(caches, num_caches, reader, ctx, &key, &key_cap, &target);
+        if (!cv)
+        {
+            ESP_LOGE(CACHE_TAG, "Invalid or truncated snapshot entry %u", (unsigned int)done);
+            ok = 0;
+            break;
+        }
+        if (n > 0 && (target != batch_target || n == RESTORE_BATCH))
+        {
+            restored += restoreBatch(caches[batch_target], batch, n);
+            n = 0;
+        }
+        batch_target = target;
+        batch[n++] = cv;
     }
-    cache->clock_hand = 0;
-    cache->hash_size = next_prime(cache_size * 2);
-    cache->hash_table = (HashEntry*)malloc(cache->hash_size * sizeof(HashEntry));
-    if (cache->hash_table)
+    if (n > 0)
     {
-        memset(cache->hash_table, 0, cache->hash_size * sizeof(HashEntry));
+        restored += restoreBatch(caches[batch_target], batch, n);
     }
-    cache->hash_used = 0;
-    cache->value_free = value_free;
 
-    cache->lock = xSemaphoreCreateMutex();
-    if (!cache->lock || !cache->cache.keys || !cache->cache.values || !cache->hash_table)
+    free(key);
+    return ok ? restored : -1;
+}
+
+int restoreCache(RefBitClockCache* cache, CacheSnapshotReader reader, void* ctx)
+{
+    return restoreCaches(&cache, 1, reader, ctx);
+}
+
+int iterateCache(RefBitClockCache* cache, CacheCursor* cursor, CacheValue* out[], int max)
+{
+    int n = 0;
+
+    cache_lock(cache);
+    while (n < max && cursor->next < cache->cache_size)
     {
-        ESP_LOGE(CACHE_TAG, "Failed to allocate cache resources");
-        free(cache->cache.keys);
-        free(cache->cache.values);
-        free(cache->hash_table);
-        if (cache->lock)
+        CacheValue* cv = cache->cache.values[cursor->next++];
+        if (cv && !valueExpired(cv) && holdValue(cache, cv))
         {
-            vSemaphoreDelete(cache->lock);
+            out[n++] = cv;
         }
-        free(cache);
-        return NULL;
     }
-
-    return cache;
+    cache_unlock(cache);
+    return n;
 }
 
-void printCacheState(RefBitClockCache* cache)
+int forEachCache(RefBitClockCache* cache, CacheVisitor visitor, void* ctx)
 {
-    char state[256] = {0};
-    int offset = 0;
-    for (int i = 0; i < cache->cache_size; i++)
+    CacheCursor cursor = CACHE_CURSOR_INIT;
+    CacheValue* batch[REFBIT_CACHE_WALK_BATCH];
+    int visited = 0;
+    int stopped = 0;
+    int n;
+
+    while (!stopped && (n = iterateCache(cache, &cursor, batch, REFBIT_CACHE_WALK_BATCH)) > 0)
     {
-        if (cache->cache.keys[i])
+        for (int i = 0; i < n && !stopped; i++)
         {
-            CacheValue* cv = cache->cache.values[i];
-            offset += snprintf(state + offset, sizeof(state) - offset, "[%d: %s, ref=%d, bit=%d] ",
-                               i, cache->cache.keys[i],
-                               cv ? cv->refcount : 0,
-                               cv ? cv->ref_bit : 0);
+            visited++;
+            stopped = !visitor(valueKey(batch[i]), batch[i], ctx);
         }
+        releaseValueBatch(cache, batch, n);
     }
-    ESP_LOGI(CACHE_TAG, "Cache state (hand=%d): %s", cache->clock_hand, state);
+    return visited;
 }
 
-static int findClockVictim(RefBitClockCache* cache)
+const char* getCacheValueKey(const CacheValue* cv)
 {
-    int start_hand = cache->clock_hand;
-    int attempts = 0;
-    int max_attempts = cache->cache_size * 2;
+    return (const char*)(cv + 1);
+}
 
-    while (attempts < max_attempts)
+/*
+ * Batch calls tag entries of out_cvs by setting the low pointer bit:
+ * lookupBatchLockFree() marks stale holds it drops after leaving the reader
+ * section, accessCacheBatch() the values it allocated for misses until it
+ * holds the lock.
+ */
+#define BATCH_TAG ((uintptr_t)1)
+
+// Resolves lock-free hits for keys; misses and retries are left NULL.
+static void lookupBatchLockFree(RefBitClockCache* cache, const char* const keys[], int n, CacheValue* out_cvs[])
+{
+    int epoch = enterReader(cache);
+    HashEntry* table = __atomic_load_n(&cache->hash_table, __ATOMIC_ACQUIRE);
+    unsigned int next_hash = n > 0 ? keyHash(cache, keys[0]) : 0;
+
+    for (int i = 0; i < n; i++)
     {
-        int idx = cache->clock_hand;
-        CacheValue* cv = cache->cache.values[idx];
+        unsigned int hash = next_hash;
 
-        if (!cv || !cache->cache.keys[idx])
+        // Hash the next key and start fetching its bucket while this one is probed.
+        if (i + 1 < n)
         {
-            cache->clock_hand = (idx + 1) % cache->cache_size;
-            return idx;
+            next_hash = keyHash(cache, keys[i + 1]);
+            __builtin_prefetch(&table[homeBucket(table, next_hash)]);
         }
 
-        if (cv->refcount == 0 && cv->ref_bit == 0)
+        CacheValue* stale = NULL;
+        out_cvs[i] = NULL;
+        if (lookupInReader(cache, keys[i], hash, &out_cvs[i], &stale, NULL) != LOOKUP_HIT)
         {
-            cache->clock_hand = (idx + 1) % cache->cache_size;
-            return idx;
+            out_cvs[i] = stale ? (CacheValue*)((uintptr_t)stale | BATCH_TAG) : NULL;
         }
-
-        cv->ref_bit = 0;
-        cache->clock_hand = (idx + 1) % cache->cache_size;
-        attempts++;
     }
 
-    for (int i = 0; i < cache->cache_size; i++)
+    exitReader(cache, epoch);
+
+    for (int i = 0; i < n; i++)
     {
-        if (!cache->cache.keys[i])
+        if ((uintptr_t)out_cvs[i] & BATCH_TAG)
         {
-            return i;
+            releaseValue(cache, (CacheValue*)((uintptr_t)out_cvs[i] & ~BATCH_TAG));
+            out_cvs[i] = NULL;
         }
     }
-
-    ESP_LOGW(CACHE_TAG, "No suitable victim found, forcing eviction of start_hand=%d", start_hand);
-    return start_hand;
 }
 
-void rehash(RefBitClockCache* cache)
+int accessCacheBatch(RefBitClockCache* cache, const char* const keys[], void* const values[], const size_t value_sizes[],
+                     int n, CacheValue* out_cvs[])
 {
-    int old_size = cache->hash_size;
-    HashEntry* old_table = cache->hash_table;
-    cache->hash_size = next_prime(old_size * 2);
-    cache->hash_table = (HashEntry*)malloc(cache->hash_size * sizeof(HashEntry));
-    if (!cache->hash_table)
+    lookupBatchLockFree(cache, keys, n, out_cvs);
+
+    int misses = 0;
+    for (int i = 0; i < n; i++)
     {
-        ESP_LOGE(CACHE_TAG, "Failed to allocate new hash table");
-        cache->hash_table = old_table;
-        cache->hash_size = old_size;
-        return;
+        if (!out_cvs[i])
+        {
+            CacheValue* fresh = newCacheValueCopy(cache, keys[i], keyHash(cache, keys[i]), values[i], value_sizes[i]);
+            out_cvs[i] = fresh ? (CacheValue*)((uintptr_t)fresh | BATCH_TAG) : NULL;
+            misses++;
+        }
     }
-    memset(cache->hash_table, 0, cache->hash_size * sizeof(HashEntry));
-    cache->hash_used = 0;
 
-    for (int i = 0; i < old_size; i++)
+    if (misses > 0)
     {
-        if (old_table[i].state == STATE_OCCUPIED)
+        cache_lock(cache);
+        for (int i = 0; i < n; i++)
         {
-            unsigned int h = hash(old_table[i].key, cache->hash_size);
-            while (cache->hash_table[h].state == STATE_OCCUPIED)
+            if (!((uintptr_t)out_cvs[i] & BATCH_TAG))
             {
-                h = (h + 1) % cache->hash_size;
+                continue;
             }
-            cache->hash_table[h] = old_table[i];
-            cache->hash_used++;
+
+            CacheValue* fresh = (CacheValue*)((uintptr_t)out_cvs[i] & ~BATCH_TAG);
+            CacheValue* cv = holdLocked(cache, keys[i], fresh->hash);
+            if (cv)
+            {
+                discardCacheValue(cache, fresh);
+            }
+            else
+            {
+                CACHE_STAT_INC(cache, misses);
+                cv = admitValue(cache, fresh, findCacheIndex(cache, keys[i], fresh->hash));
+            }
+            out_cvs[i] = cv;
         }
+        cache_unlock(cache);
     }
 
-    free(old_table);
-}
-
-void insertHash(RefBitClockCache* cache, char* key, int idx)
-{
-    if ((cache->hash_used * 10) / cache->hash_size >= 7)
+    int found = 0;
+    for (int i = 0; i < n; i++)
     {
-        rehash(cache);
+        found += out_cvs[i] != NULL;
     }
+    return found;
+}
 
-    unsigned int h = hash(key, cache->hash_size);
-    int tombstone_idx = -1;
+int lookupCacheBatch(RefBitClockCache* cache, const char* const keys[], int n, CacheValue* out_cvs[])
+{
+    lookupBatchLockFree(cache, keys, n, out_cvs);
 
-    while (1)
+    int found = 0;
+    int locked = 0;
+    for (int i = 0; i < n; i++)
     {
-        if (cache->hash_table[h].state == STATE_EMPTY)
+        if (!out_cvs[i])
         {
-            if (tombstone_idx != -1)
+            // Misses and lock-free retries are resolved under one lock.
+            if (!locked)
             {
-                h = tombstone_idx;
+                cache_lock(cache);
+                locked = 1;
             }
-
-            cache->hash_table[h].key = key;
-            cache->hash_table[h].cache_index = idx;
-            cache->hash_table[h].state = STATE_OCCUPIED;
-            cache->hash_used++;
-            return;
-        }
-        else if (cache->hash_table[h].state == STATE_TOMBSTONE)
-        {
-            if (tombstone_idx == -1)
+            out_cvs[i] = holdLocked(cache, keys[i], keyHash(cache, keys[i]));
+            if (!out_cvs[i])
             {
-                tombstone_idx = h;
+                CACHE_STAT_INC(cache, misses);
             }
         }
-        else if (cache->hash_table[h].state == STATE_OCCUPIED && strcmp(cache->hash_table[h].key, key) == 0)
-        {
-            cache->hash_table[h].cache_index = idx;
-            return;
-        }
+        found += out_cvs[i] != NULL;
+    }
 
-        h = (h + 1) % cache->hash_size;
+    if (locked)
+    {
+        cache_unlock(cache);
     }
+    return found;
 }
 
-void eraseHash(RefBitClockCache* cache, const char* key)
+typedef struct PendingLoad
 {
-    unsigned int h = hash(key, cache->hash_size);
+    struct PendingLoad* next;
+    const char* key;
+    unsigned int hash;
+    SemaphoreHandle_t done;
+    int waiters;
+    CacheValue* result;
+} PendingLoad;
 
-    while (cache->hash_table[h].state != STATE_EMPTY)
+// Must be called with the lock held.
+static PendingLoad* findPendingLoad(RefBitClockCache* cache, const char* key, unsigned int hash)
+{
+    for (PendingLoad* p = cache->pending_loads; p; p = p->next)
     {
-        if (cache->hash_table[h].state == STATE_OCCUPIED && strcmp(cache->hash_table[h].key, key) == 0)
+        if (p->hash == hash && keysEqual(cache, p->key, key))
         {
-            cache->hash_table[h].state = STATE_TOMBSTONE;
-            cache->hash_used--;
-            return;
+            return p;
         }
-
-        h = (h + 1) % cache->hash_size;
     }
+    return NULL;
 }
 
-int getCacheIndex(RefBitClockCache* cache, const char* key)
+// Must be called with the lock held.
+static void unlinkPendingLoad(RefBitClockCache* cache, PendingLoad* pending)
 {
-    unsigned int h = hash(key, cache->hash_size);
-
-    while (cache->hash_table[h].state != STATE_EMPTY)
+    PendingLoad** link = &cache->pending_loads;
+    while (*link != pending)
     {
-        if (cache->hash_table[h].state == STATE_OCCUPIED && strcmp(cache->hash_table[h].key, key) == 0)
-        {
-            return cache->hash_table[h].cache_index;
-        }
-
-        h = (h + 1) % cache->hash_size;
+        link = &(*link)->next;
     }
+    *link = pending->next;
+}
 
-    return -1;
+static void freePendingLoad(PendingLoad* pending)
+{
+    vSemaphoreDelete(pending->done);
+    free(pending);
 }
 
-CacheValue* accessCache(RefBitClockCache* cache, const char* key, void* value, size_t value_size)
+CacheValue* getOrLoad(RefBitClockCache* cache, const char* key, CacheLoader loader, void* ctx)
 {
-    cache_lock(cache);
+    CacheValue* cv = NULL;
+    unsigned int hash = keyHash(cache, key);
+    if (lookupLockFree(cache, key, hash, &cv) == LOOKUP_HIT)
+    {
+        return cv;
+    }
 
-    int index = getCacheIndex(cache, key);
+    cache_lock(cache);
 
-    if (index != -1)
+    cv = holdLocked(cache, key, hash);
+    if (cv)
     {
-        CacheValue* cv = cache->cache.values[index];
-
-        if (cv)
-        {
-            cv->refcount++;
-            cv->ref_bit = 1;
-            ESP_LOGI(CACHE_TAG, "Cache hit → key: %s in line %d ref=%d, bit=%d", key, index, cv->refcount, cv->ref_bit);
-            printCacheState(cache);
-            cache_unlock(cache);
-            return cv;
-        }
+        cache_unlock(cache);
+        return cv;
     }
 
-    int victim_idx = findClockVictim(cache);
-
-    if (cache->cache.keys[victim_idx])
+    CACHE_STAT_INC(cache, misses);
+    if (negativeLookup(cache, hash))
     {
-        eraseHash(cache, cache->cache.keys[victim_idx]);
-        free(cache->cache.keys[victim_idx]);
-        cache->cache.keys[victim_idx] = NULL;
+        cache_unlock(cache);
+        return NULL;
     }
+    PendingLoad* pending = findPendingLoad(cache, key, hash);
+    if (pending)
+    {
+        // Another task is already loading this key; wait for its result.
+        pending->waiters++;
+        cache_unlock(cache);
 
-    CacheValue* old = cache->cache.values[victim_idx];
+        xSemaphoreTake(pending->done, portMAX_DELAY);
 
-    if (old)
-    {
-        if (old->refcount == 0)
+        cache_lock(cache);
+        cv = pending->result;
+        int last = --pending->waiters == 0;
+        cache_unlock(cache);
+
+        // Pass the wakeup on to the next waiter; the last one frees the record.
+        if (last)
         {
-            cache->value_free(old->data);
-            free(old);
+            freePendingLoad(pending);
         }
         else
         {
-            old->index = -1;
+            xSemaphoreGive(pending->done);
         }
-        cache->cache.values[victim_idx] = NULL;
+        return cv;
     }
 
-    cache->cache.keys[victim_idx] = strdup(key);
-    if (!cache->cache.keys[victim_idx])
+    pending = (PendingLoad*)malloc(sizeof(PendingLoad));
+    if (pending)
     {
-        ESP_LOGE(CACHE_TAG, "Failed to allocate key");
-        cache_unlock(cache);
-        return NULL;
+        pending->done = xSemaphoreCreateBinary();
+        if (!pending->done)
+        {
+            free(pending);
+            pending = NULL;
+        }
     }
-    CacheValue* cv = (CacheValue*)malloc(sizeof(CacheValue));
-    if (!cv)
+    if (!pending)
     {
-        ESP_LOGE(CACHE_TAG, "Failed to allocate CacheValue");
-        free(cache->cache.keys[victim_idx]);
-        cache->cache.keys[victim_idx] = NULL;
+        ESP_LOGE(CACHE_TAG, "Failed to allocate pending load");
         cache_unlock(cache);
         return NULL;
     }
-    cv->data = malloc(value_size);
-    if (!cv->data)
+    pending->key = key;
+    pending->hash = hash;
+    pending->waiters = 0;
+    pending->result = NULL;
+    pending->next = cache->pending_loads;
+    cache->pending_loads = pending;
+    cache_unlock(cache);
+
+    void* value = NULL;
+    size_t value_size = 0;
+    CacheValue* fresh = NULL;
+    int loaded = loader(key, ctx, &value, &value_size);
+    if (loaded == 1)
     {
-        ESP_LOGE(CACHE_TAG, "Failed to allocate data");
-        free(cv);
-        free(cache->cache.keys[victim_idx]);
-        cache->cache.keys[victim_idx] = NULL;
-        cache_unlock(cache);
-        return NULL;
+        fresh = newCacheValueCopy(cache, key, hash, value, value_size);
     }
-    memcpy(cv->data, value, value_size);
-    cv->refcount = 1;
-    cv->index = victim_idx;
-    cv->ref_bit = 1;
-    cache->cache.values[victim_idx] = cv;
-
-    insertHash(cache, cache->cache.keys[victim_idx], victim_idx);
-
-    ESP_LOGI(CACHE_TAG, "Cache miss → stored key: %s in line %d ref=1, bit=1 (victim was %d)", key, victim_idx, victim_idx);
-    printCacheState(cache);
 
+    cache_lock(cache);
+    if (fresh)
+    {
+        fresh = admitValue(cache, fresh, findCacheIndex(cache, key, hash));
+    }
+    else if (loaded == REFBIT_CACHE_MISSING && cache->negative && findCacheIndex(cache, key, hash) == -1)
+    {
+        // An insert that raced the loader wins.
+        negativeInsert(cache, hash);
+    }
+    unlinkPendingLoad(cache, pending);
+    pending->result = fresh;
+    int waiters = pending->waiters;
+    if (fresh && waiters > 0)
+    {
+        __atomic_add_fetch(&fresh->refcount, waiters, __ATOMIC_SEQ_CST);
+    }
     cache_unlock(cache);
-    return cv;
+
+    if (waiters == 0)
+    {
+        freePendingLoad(pending);
+    }
+    else
+    {
+        xSemaphoreGive(pending->done);
+    }
+    return fresh;
 }
 
 void releaseValue(RefBitClockCache* cache, CacheValue* cv)
@@ -376,28 +3178,149 @@ void releaseValue(RefBitClockCache* cache, CacheValue* cv)
         return;
     }
 
-    cache_lock(cache);
-    cv->refcount--;
+    // Only the release that frees an evicted value needs the lock.
+    int epoch = enterReader(cache);
+    int owned = 0;
+    if (__atomic_sub_fetch(&cv->refcount, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        owned = __atomic_load_n(&cv->index, __ATOMIC_SEQ_CST) == -1 && claimValue(cv);
+        if (!owned)
+        {
+            unpinValue(cache);
+        }
+    }
+    exitReader(cache, epoch);
 
-    if (cv->refcount == 0 && cv->index == -1)
+    if (owned && cache->free_mode != REFBIT_CACHE_FREE_INLINE)
     {
-        cache->value_free(cv->data);
-        free(cv);
+        queueFree(cache, cv);
     }
+    else if (owned)
+    {
+        cache_lock(cache);
+        retireValue(cache, cv);
+        cache_unlock(cache);
+    }
+}
 
-    cache_unlock(cache);
+void getCacheStats(RefBitClockCache* cache, RefBitClockCacheStats* stats)
+{
+    const CacheCounters* c = &cache->counters;
+
+    stats->hits = __atomic_load_n(&c->hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&c->misses, __ATOMIC_RELAXED);
+    stats->evictions = __atomic_load_n(&c->evictions, __ATOMIC_RELAXED);
+    stats->no_victim = __atomic_load_n(&c->no_victim, __ATOMIC_RELAXED);
+    stats->deferred_frees = __atomic_load_n(&c->deferred_frees, __ATOMIC_RELAXED);
+    stats->sweeps = __atomic_load_n(&c->sweeps, __ATOMIC_RELAXED);
+    stats->max_sweep = __atomic_load_n(&c->max_sweep, __ATOMIC_RELAXED);
+    stats->probes = __atomic_load_n(&c->probes, __ATOMIC_RELAXED);
+    stats->max_probe = __atomic_load_n(&c->max_probe, __ATOMIC_RELAXED);
+    stats->rehashes = __atomic_load_n(&c->rehashes, __ATOMIC_RELAXED);
+    stats->oversized = __atomic_load_n(&c->oversized, __ATOMIC_RELAXED);
+    stats->expirations = __atomic_load_n(&c->expirations, __ATOMIC_RELAXED);
+    stats->invalidations = __atomic_load_n(&c->invalidations, __ATOMIC_RELAXED);
+    stats->queued_frees = __atomic_load_n(&c->queued_frees, __ATOMIC_RELAXED);
+    stats->front_hits = __atomic_load_n(&c->front_hits, __ATOMIC_RELAXED);
+    stats->negative_hits = __atomic_load_n(&c->negative_hits, __ATOMIC_RELAXED);
+    stats->lock_timeouts = __atomic_load_n(&c->lock_timeouts, __ATOMIC_RELAXED);
+    stats->max_lock_wait = __atomic_load_n(&c->max_lock_wait, __ATOMIC_RELAXED);
+    stats->max_lock_hold = __atomic_load_n(&c->max_lock_hold, __ATOMIC_RELAXED);
+    for (int i = 0; i < REFBIT_CACHE_LOCK_BUCKETS; i++)
+    {
+        stats->lock_wait_hist[i] = __atomic_load_n(&c->lock_wait_hist[i], __ATOMIC_RELAXED);
+        stats->lock_hold_hist[i] = __atomic_load_n(&c->lock_hold_hist[i], __ATOMIC_RELAXED);
+    }
+    stats->bytes_used = __atomic_load_n(&cache->bytes_used, __ATOMIC_RELAXED);
+
+    unsigned int sweep_steps = __atomic_load_n(&c->sweep_steps, __ATOMIC_RELAXED);
+    unsigned int probe_steps = __atomic_load_n(&c->probe_steps, __ATOMIC_RELAXED);
+    stats->avg_sweep = stats->sweeps ? (float)sweep_steps / stats->sweeps : 0.0f;
+    stats->avg_probe = stats->probes ? (float)probe_steps / stats->probes : 0.0f;
+}
+
+void resetCacheStats(RefBitClockCache* cache)
+{
+    unsigned int* counters = (unsigned int*)&cache->counters;
+
+    for (size_t i = 0; i < sizeof(CacheCounters) / sizeof(unsigned int); i++)
+    {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+void releaseValueBatch(RefBitClockCache* cache, CacheValue* const cvs[], int n)
+{
+    CacheValue* owned = NULL;
+
+    int epoch = enterReader(cache);
+    for (int i = 0; i < n; i++)
+    {
+        CacheValue* cv = cvs[i];
+        if (cv && __atomic_sub_fetch(&cv->refcount, 1, __ATOMIC_SEQ_CST) == 0)
+        {
+            if (__atomic_load_n(&cv->index, __ATOMIC_SEQ_CST) == -1 && claimValue(cv))
+            {
+                cv->retired_next = owned;
+                owned = cv;
+            }
+            else
+            {
+                unpinValue(cache);
+            }
+        }
+    }
+    exitReader(cache, epoch);
+
+    // Values this batch freed are queued or retired under a single lock.
+    if (owned && cache->free_mode != REFBIT_CACHE_FREE_INLINE)
+    {
+        while (owned)
+        {
+            CacheValue* next = owned->retired_next;
+            queueFree(cache, owned);
+            owned = next;
+        }
+    }
+    else if (owned)
+    {
+        cache_lock(cache);
+        while (owned)
+        {
+            CacheValue* next = owned->retired_next;
+            retireValue(cache, owned);
+            owned = next;
+        }
+        cache_unlock(cache);
+    }
 }
 
 void freeCache(RefBitClockCache* cache)
 {
-    for (int i = 0; i < cache->cache_size; i++)
+    // Front references go first, so values only they kept alive are freed below.
+    if (cache->front)
     {
-        if (cache->cache.keys[i])
+        for (unsigned int i = 0; i < portNUM_PROCESSORS * (cache->front_mask + 1); i++)
         {
-            eraseHash(cache, cache->cache.keys[i]);
-            free(cache->cache.keys[i]);
-            cache->cache.keys[i] = NULL;
+            releaseValue(cache, cache->front[i].cv);
+            cache->front[i].cv = NULL;
         }
+    }
+
+    if (cache->free_task)
+    {
+        __atomic_store_n(&cache->free_task_state, FREE_TASK_STOPPING, __ATOMIC_RELEASE);
+        xSemaphoreGive(cache->free_sem);
+        while (__atomic_load_n(&cache->free_task_state, __ATOMIC_ACQUIRE) != FREE_TASK_STOPPED)
+        {
+            vTaskDelay(1);
+        }
+    }
+    drainDeferredFrees(cache);
+
+    for (int i = 0; i < cache->cache_size; i++)
+    {
+        cache->cache.keys[i] = NULL;
 
         CacheValue* cv = cache->cache.values[i];
 
@@ -406,22 +3329,31 @@ void freeCache(RefBitClockCache* cache)
             if (cv->refcount > 0)
             {
                 ESP_LOGW(CACHE_TAG, "Warning: freeing held CacheValue at %d (ref=%d)", i, cv->refcount);
-                cache->value_free(cv->data);
-                free(cv);
-            }
-            else if (cv->refcount == 0)
-            {
-                cache->value_free(cv->data);
-                free(cv);
             }
+            discardCacheValue(cache, cv);
             cache->cache.values[i] = NULL;
         }
     }
 
-    free(cache->cache.keys);
-    free(cache->cache.values);
-    free(cache->hash_table);
+    reclaimRetired(cache);
+
+    SlotArrays arrays;
+    takeSlotArrays(cache, &arrays);
+    freeSlotArrays(&arrays);
+    freeHashTable(cache->hash_table);
+    freeHashTable(cache->old_hash_table);
+    freePool(&cache->pool);
 
+    if (cache->victim_sem)
+    {
+        vSemaphoreDelete(cache->victim_sem);
+    }
+    if (cache->free_sem)
+    {
+        vSemaphoreDelete(cache->free_sem);
+    }
+    free(cache->front);
+    free(cache->negative);
     vSemaphoreDelete(cache->lock);
     free(cache);
 }
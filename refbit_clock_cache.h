@@ -20,28 +20,132 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
+#include <freertos/task.h>
 #include <esp_log.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 static const char *CACHE_TAG = "RefBitClockCache";
 
+#define REFBIT_CACHE_TRACE_NONE   0
+#define REFBIT_CACHE_TRACE_EVENTS 1
+#define REFBIT_CACHE_TRACE_STATE  2
+
+/*
+ * Build-time tracing level for the cache operations.
+ * NONE compiles out all per-access logging, EVENTS logs hits, misses and
+ * evictions, STATE additionally dumps the whole cache after every operation.
+ * Override with -DREFBIT_CACHE_TRACE=<level> or CONFIG_REFBIT_CACHE_TRACE.
+ */
+#ifndef REFBIT_CACHE_TRACE
+#ifdef CONFIG_REFBIT_CACHE_TRACE
+#define REFBIT_CACHE_TRACE CONFIG_REFBIT_CACHE_TRACE
+#else
+#define REFBIT_CACHE_TRACE REFBIT_CACHE_TRACE_NONE
+#endif
+#endif
+
+/*
+ * Number of old-table buckets migrated per insert or erase while an
+ * incremental rehash is in progress. Bounds the extra work per call.
+ */
+#ifndef REFBIT_CACHE_REHASH_STEP
+#define REFBIT_CACHE_REHASH_STEP 8
+#endif
+
+/*
+ * Number of entries forEachCache() holds per lock acquisition. Bounds how
+ * long a walk keeps misses waiting at a time.
+ */
+#ifndef REFBIT_CACHE_WALK_BATCH
+#define REFBIT_CACHE_WALK_BATCH 16
+#endif
+
+/*
+ * Hot-path statistics counters reported by getCacheStats(). They are relaxed
+ * atomics; build with -DREFBIT_CACHE_STATS=0 to compile them out.
+ */
+#ifndef REFBIT_CACHE_STATS
+#ifdef CONFIG_REFBIT_CACHE_STATS
+#define REFBIT_CACHE_STATS CONFIG_REFBIT_CACHE_STATS
+#else
+#define REFBIT_CACHE_STATS 1
+#endif
+#endif
+
+/*
+ * What a miss does when every slot holds a value that is still in use:
+ * BYPASS returns the new value without caching it (it is freed on its last
+ * release), FAIL returns NULL, WAIT blocks up to victim_wait_ms for a slot to
+ * be released and then fails.
+ */
+#define REFBIT_CACHE_NO_VICTIM_BYPASS 0
+#define REFBIT_CACHE_NO_VICTIM_FAIL   1
+#define REFBIT_CACHE_NO_VICTIM_WAIT   2
+
+/*
+ * Where value_free runs once nobody holds an evicted, replaced or invalidated
+ * value. INLINE frees it in place: under the lock for evictions, in
+ * releaseValue() for a last release. DEFERRED pushes it onto a lock-free queue
+ * that the next miss drains before allocating, or drainDeferredFrees(). TASK
+ * drains the queue from a low-priority cleanup task owned by the cache.
+ */
+#define REFBIT_CACHE_FREE_INLINE   0
+#define REFBIT_CACHE_FREE_DEFERRED 1
+#define REFBIT_CACHE_FREE_TASK     2
+
+/*
+ * Eviction policies. CLOCK keeps one reference bit per slot. GCLOCK keeps a
+ * saturating hit counter of up to gclock_max per slot; the hand decrements
+ * it, so frequently used entries survive scans of keys that are used once.
+ */
+#define REFBIT_CACHE_POLICY_CLOCK  0
+#define REFBIT_CACHE_POLICY_GCLOCK 1
+
+/*
+ * Buckets of the lock wait and hold histograms, in microseconds: bucket 0
+ * counts times under 1 us, bucket i covers [2^(i-1), 2^i) us and the last
+ * bucket everything from 1024 us up.
+ */
+#define REFBIT_CACHE_LOCK_BUCKETS 12
+
+// Results of accessCacheTimeout(), lookupCacheTimeout() and lookupCacheStatus().
+#define REFBIT_CACHE_OK      0
+#define REFBIT_CACHE_BUSY    1
+#define REFBIT_CACHE_MISSING 2
+
 #define STATE_EMPTY     0
 #define STATE_OCCUPIED  1
 #define STATE_TOMBSTONE 2
 
-typedef struct
+/*
+ * refcount and index are accessed with atomic builtins because cache hits
+ * update them without taking the cache lock. The key string is stored in the
+ * same allocation, right after the structure. Reference bits are kept per slot
+ * in RefBitClockCache::ref_bits. expires is the tick deadline of the entry,
+ * 0 if it never expires.
+ */
+typedef struct CacheValue
 {
     void* data;
     int refcount;
     int index;
-    int ref_bit;
+    unsigned int hash;
+    size_t size;
+    TickType_t expires;
+    struct CacheValue* retired_next;
 } CacheValue;
 
+/*
+ * hash is the full hashKey() value of key. Probes compare it before the key
+ * string, and rehashing and backward-shift deletion reuse it.
+ */
 typedef struct
 {
     char* key;
     int cache_index;
     int state;
+    unsigned int hash;
 } HashEntry;
 
 typedef struct
@@ -50,18 +154,297 @@ typedef struct
     CacheValue** values;
 } CacheArray;
 
+/*
+ * Optional preallocated storage sized at createCacheWithConfig(). Each slab
+ * entry is a CacheValue followed by room for a key of up to max_key_len
+ * characters, and owns the value slot with the same index.
+ */
+typedef struct
+{
+    unsigned char* slab;
+    size_t stride;
+    int count;
+    unsigned char* value_slots;
+    size_t value_slot_size;
+    CacheValue* free_list;
+    portMUX_TYPE lock;
+} CachePool;
+
+/*
+ * One entry of a per-core front cache. A set cv carries a reference of its
+ * own, so a front hit only needs an atomic increment. generation is the
+ * cache's front_generation when the entry was last known to be cached.
+ */
+typedef struct
+{
+    CacheValue* cv;
+    unsigned int generation;
+} CacheFrontSlot;
+
+/*
+ * One entry of the negative cache: the hash of a key known to be missing.
+ * Keys are not stored, so another key with the same hash also reads as
+ * missing until the entry expires or is replaced.
+ */
+typedef struct
+{
+    unsigned int hash;
+    TickType_t expires;
+    int used;
+} CacheNegativeEntry;
+
+// Raw counters; updated with relaxed atomics and wrap on overflow.
+typedef struct
+{
+    unsigned int hits;
+    unsigned int misses;
+    unsigned int evictions;
+    unsigned int no_victim;
+    unsigned int deferred_frees;
+    unsigned int sweeps;
+    unsigned int sweep_steps;
+    unsigned int max_sweep;
+    unsigned int probes;
+    unsigned int probe_steps;
+    unsigned int max_probe;
+    unsigned int rehashes;
+    unsigned int oversized;
+    unsigned int expirations;
+    unsigned int invalidations;
+    unsigned int queued_frees;
+    unsigned int front_hits;
+    unsigned int negative_hits;
+    unsigned int lock_timeouts;
+    unsigned int max_lock_wait;
+    unsigned int max_lock_hold;
+    unsigned int lock_wait_hist[REFBIT_CACHE_LOCK_BUCKETS];
+    unsigned int lock_hold_hist[REFBIT_CACHE_LOCK_BUCKETS];
+} CacheCounters;
+
+typedef struct
+{
+    unsigned int hits;              // Lookups served from the cache.
+    unsigned int misses;            // Lookups that did not find the key.
+    unsigned int evictions;         // Values evicted by the clock to make room.
+    unsigned int no_victim;         // Misses that found every slot held.
+    unsigned int deferred_frees;    // Evicted or replaced values freed later because they were held.
+    unsigned int sweeps;            // Clock victim searches.
+    float avg_sweep;                // Average slots examined per victim search.
+    unsigned int max_sweep;         // Longest victim search.
+    unsigned int probes;            // Hash table lookups measured; lock-free hits are sampled.
+    float avg_probe;                // Average buckets examined per lookup.
+    unsigned int max_probe;         // Longest lookup probe.
+    unsigned int rehashes;          // Hash table rebuilds.
+    unsigned int oversized;         // Values over max_value_bytes or max_bytes that were not cached.
+    unsigned int expirations;       // Expired entries removed by the clock or replaced on access.
+    unsigned int invalidations;     // Entries removed by the invalidate functions.
+    unsigned int queued_frees;      // Values freed by a deferred drain instead of in place.
+    unsigned int front_hits;        // Hits served by the per-core front cache (included in hits).
+    unsigned int negative_hits;     // Lookups answered as known missing (included in misses).
+    unsigned int lock_timeouts;     // Timed accesses that gave up waiting for the lock.
+    unsigned int max_lock_wait;     // Longest lock wait in microseconds (lock_timing).
+    unsigned int max_lock_hold;     // Longest lock hold in microseconds (lock_timing).
+    unsigned int lock_wait_hist[REFBIT_CACHE_LOCK_BUCKETS];  // Lock waits by REFBIT_CACHE_LOCK_BUCKETS bucket.
+    unsigned int lock_hold_hist[REFBIT_CACHE_LOCK_BUCKETS];  // Lock holds by bucket.
+    size_t bytes_used;              // Key and value bytes currently cached.
+} RefBitClockCacheStats;
+
+/*
+ * Optional key hash and equality for createCacheWithConfig(). len is key_len,
+ * or the string length for NUL-terminated keys.
+ */
+typedef unsigned int (*CacheHashFn)(const void* key, size_t len);
+typedef int (*CacheKeyEqualFn)(const void* a, const void* b, size_t len);
+
+/*
+ * Eviction hook. Called with the cache lock held for every value the clock
+ * evicts while no task holds it, just before the value is freed; invalidated,
+ * replaced and expired values are not reported. hash is the key's cache hash.
+ * Must be quick and must not call into the cache.
+ */
+typedef void (*CacheEvictHook)(const char* key, unsigned int hash, const void* data, size_t size, void* ctx);
+
 typedef struct
 {
     int cache_size;
+    uint32_t meta_caps;
+    uint32_t value_caps;
+    size_t inline_value_size;
+    size_t key_len;
+    CacheHashFn hash_fn;
+    CacheKeyEqualFn key_equal;
+    int int_keys;
     CacheArray cache;
     HashEntry* hash_table;
     int hash_size;
     int hash_used;
+    int hash_tombstones;
+    HashEntry* old_hash_table;
+    int old_hash_size;
+    int rehash_pos;
+    int fixed_hash;
     void (*value_free)(void*);
+    CacheEvictHook evict_hook;
+    void* evict_ctx;
     int clock_hand;
+    int* free_slots;
+    int free_count;
+    unsigned int* ref_bits;
+    unsigned char* ref_counts;
+    int eviction_policy;
+    int gclock_max;
+    TickType_t* expiry;
+    int ttl_entries;
+    TickType_t default_ttl;
+    size_t max_bytes;
+    size_t max_value_bytes;
+    size_t bytes_used;
+    int pinned;
+    int free_mode;
+    CacheValue* free_queue;
+    SemaphoreHandle_t free_sem;
+    TaskHandle_t free_task;
+    int free_task_state;
+    CacheFrontSlot* front;
+    unsigned int front_mask;
+    unsigned int front_generation;
+    CacheNegativeEntry* negative;
+    unsigned int negative_mask;
+    TickType_t negative_ttl;
+    portMUX_TYPE negative_lock;
+    int no_victim_policy;
+    TickType_t victim_wait;
+    SemaphoreHandle_t victim_sem;
+    int victim_waiters;
     SemaphoreHandle_t lock;
+    int lock_spin;
+    int lock_timing;
+    int64_t lock_acquired;
+    unsigned int seq;
+    int readers[2];
+    unsigned int reader_epoch;
+    CacheValue* retired_values;
+    struct HashTableHeader* retired_tables;
+    CacheValue* waiting_values;
+    struct HashTableHeader* waiting_tables;
+    int retired_count;
+    struct PendingLoad* pending_loads;
+    CachePool pool;
+    CacheCounters counters;
 } RefBitClockCache;
 
+typedef struct
+{
+    int cache_size;               // Maximum number of entries.
+    void (*value_free)(void*);    // Frees user data on eviction.
+    int use_pool;                 // Preallocate CacheValues and keys instead of using the heap per miss.
+    int pool_spare;               // Extra pool entries for evicted values that are still held.
+    size_t max_key_len;           // Longest key stored in the pool; longer keys fall back to the heap.
+    size_t value_slot_size;       // If non-zero, values up to this size are stored in preallocated slots.
+    int fixed_hash_table;         // Power-of-two table sized from cache_size: no rehash, no tombstones.
+    int no_victim_policy;         // REFBIT_CACHE_NO_VICTIM_* applied when every slot is held.
+    int victim_wait_ms;           // Longest wait for a slot with REFBIT_CACHE_NO_VICTIM_WAIT.
+    size_t max_bytes;             // If non-zero, evict until cached key and value bytes fit this budget.
+    size_t max_value_bytes;       // If non-zero, larger values are not cached (see no_victim_policy).
+    uint32_t meta_caps;           // heap_caps flags for the cache, hash tables, CacheValues and keys; 0 = malloc.
+    uint32_t value_caps;          // heap_caps flags for value data and pool value slots; 0 = malloc.
+    size_t inline_value_size;     // Values up to this size share the CacheValue's block (meta_caps); 0 = never.
+    int default_ttl_ms;           // Lifetime of entries inserted without an explicit TTL; 0 = never expire.
+    size_t key_len;               // If non-zero, keys are binary and exactly key_len bytes long.
+    CacheHashFn hash_fn;          // Key hash; NULL = FNV-1a.
+    CacheKeyEqualFn key_equal;    // Key comparison; NULL = strcmp(), or memcmp() for binary keys.
+    int int_keys;                 // Keys are 4- or 8-byte integers (key_len): multiplicative hash unless hash_fn.
+    int eviction_policy;          // REFBIT_CACHE_POLICY_*.
+    int gclock_max;               // GCLOCK counter ceiling (1-255).
+    CacheEvictHook evict_hook;    // If set, sees each unreferenced value the clock evicts before it is freed.
+    void* evict_ctx;              // Opaque pointer passed to evict_hook.
+    int free_mode;                // REFBIT_CACHE_FREE_*: where value_free runs.
+    int free_task_priority;       // Priority of the REFBIT_CACHE_FREE_TASK cleanup task.
+    uint32_t free_task_stack;     // Stack size of the cleanup task.
+    int front_entries;            // If non-zero, per-core front cache entries (rounded up to a power of two).
+    int lock_spin;                // Non-blocking lock attempts before blocking (multicore only); 0 = block at once.
+    int lock_timing;              // Time every lock wait and hold into the lock histograms (esp_timer).
+    int negative_entries;         // If non-zero, hashes of known-missing keys remembered (rounded up to a power of two).
+    int negative_ttl_ms;          // Lifetime of a known-missing entry; 0 = until replaced or the key is cached.
+} RefBitClockCacheConfig;
+
+#define REFBIT_CACHE_DEFAULT_CONFIG()                      \
+    {                                                      \
+        .cache_size = 16,                                  \
+        .value_free = freeValue,                           \
+        .use_pool = 0,                                     \
+        .pool_spare = 4,                                   \
+        .max_key_len = 31,                                 \
+        .value_slot_size = 0,                              \
+        .fixed_hash_table = 0,                             \
+        .no_victim_policy = REFBIT_CACHE_NO_VICTIM_BYPASS, \
+        .victim_wait_ms = 10,                              \
+        .max_bytes = 0,                                    \
+        .max_value_bytes = 0,                              \
+        .meta_caps = 0,                                    \
+        .value_caps = 0,                                   \
+        .inline_value_size = 0,                            \
+        .default_ttl_ms = 0,                               \
+        .key_len = 0,                                      \
+        .hash_fn = NULL,                                   \
+        .key_equal = NULL,                                 \
+        .int_keys = 0,                                     \
+        .eviction_policy = REFBIT_CACHE_POLICY_CLOCK,      \
+        .gclock_max = 3,                                   \
+        .evict_hook = NULL,                                \
+        .evict_ctx = NULL,                                 \
+        .free_mode = REFBIT_CACHE_FREE_INLINE,             \
+        .free_task_priority = tskIDLE_PRIORITY + 1,        \
+        .free_task_stack = 2048,                           \
+        .front_entries = 0,                                \
+        .lock_spin = 0,                                    \
+        .lock_timing = 0,                                  \
+        .negative_entries = 0,                             \
+        .negative_ttl_ms = 0,                              \
+    }
+
+/*
+ * Loader used by getOrLoad() on a miss. On success it stores a pointer to the
+ * value and its size and returns 1; the value is copied into the cache and the
+ * buffer stays owned by the loader. Returns 0 if the value is unavailable, or
+ * REFBIT_CACHE_MISSING if the key does not exist; with negative_entries set,
+ * getOrLoad() then answers NULL for the key without calling the loader until
+ * the entry expires.
+ */
+typedef int (*CacheLoader)(const char* key, void* ctx, void** value, size_t* value_size);
+
+/*
+ * Predicate used by invalidateIf(). Called with the cache lock held for every
+ * cached entry; returns non-zero to remove it. Must not call into the cache.
+ */
+typedef int (*CacheKeyPredicate)(const char* key, void* data, void* ctx);
+
+/*
+ * Stream callbacks used by snapshotCache() and restoreCache(). Each call
+ * transfers exactly len bytes and returns 1, or returns 0 on failure. They
+ * are called without the cache lock, so they may block on flash or NVS.
+ */
+typedef int (*CacheSnapshotWriter)(const void* buf, size_t len, void* ctx);
+typedef int (*CacheSnapshotReader)(void* buf, size_t len, void* ctx);
+
+/*
+ * Visitor used by forEachCache(). Called without the cache lock for every
+ * cached entry, with cv held for the duration of the call; returns 0 to stop
+ * the walk. It may call into the cache.
+ */
+typedef int (*CacheVisitor)(const char* key, CacheValue* cv, void* ctx);
+
+/*
+ * Position of an iterateCache() walk in slot order. Initialize it with
+ * CACHE_CURSOR_INIT to start from the beginning.
+ */
+typedef struct
+{
+    int next;  // Next slot to examine.
+} CacheCursor;
+
+#define CACHE_CURSOR_INIT { .next = 0 }
+
 /**
  * @brief Create a new reference bit clock cache.
  *
@@ -71,10 +454,26 @@ typedef struct
  */
 RefBitClockCache* createCache(int cache_size, void (*value_free)(void*));
 
+/**
+ * @brief Create a new reference bit clock cache from a configuration.
+ * Start from REFBIT_CACHE_DEFAULT_CONFIG() and override fields as needed.
+ * With use_pool, hits and misses make no heap calls in steady state; values
+ * stored in pool slots are not passed to value_free. With key_len set, every
+ * key argument of the cache functions points at key_len bytes instead of a
+ * string; invalidatePrefix() needs string keys.
+ *
+ * @param config The cache configuration.
+ * @return Pointer to the created cache, or NULL on failure.
+ */
+RefBitClockCache* createCacheWithConfig(const RefBitClockCacheConfig* config);
+
 /**
  * @brief Access or insert a value in the cache (thread-safe).
- * If the key exists, increments refcount and sets ref_bit=1 (hit).
+ * If the key exists, increments refcount and sets the slot's reference bit (hit).
+ * Hits are served without taking the cache lock.
  * If not, evicts a victim using clock algorithm and inserts (miss).
+ * If every slot is held, or the value exceeds max_value_bytes, no_victim_policy
+ * decides the outcome of a miss.
  *
  * @param cache The cache instance.
  * @param key The key (string, duplicated internally).
@@ -84,6 +483,324 @@ RefBitClockCache* createCache(int cache_size, void (*value_free)(void*));
  */
 CacheValue* accessCache(RefBitClockCache* cache, const char* key, void* value, size_t value_size);
 
+/**
+ * @brief Look up a key without inserting it (thread-safe).
+ * On a hit, increments refcount and sets the slot's reference bit.
+ *
+ * @param cache The cache instance.
+ * @param key The key to look up.
+ * @return Held CacheValue* on a hit, NULL on a miss.
+ */
+CacheValue* lookupCache(RefBitClockCache* cache, const char* key);
+
+/**
+ * @brief accessCache() that waits at most timeout_ms for the cache lock (thread-safe).
+ * Lock-free hits never wait. A miss that REFBIT_CACHE_NO_VICTIM_WAIT sends to
+ * sleep may still wait up to victim_wait_ms for a slot.
+ *
+ * @param cache The cache instance.
+ * @param key The key (string, duplicated internally).
+ * @param value The value to insert on miss.
+ * @param value_size Size of the value in bytes.
+ * @param timeout_ms Longest wait for the lock; 0 only tries it.
+ * @param out Receives what accessCache() would return, or NULL when busy.
+ * @return REFBIT_CACHE_OK, or REFBIT_CACHE_BUSY if the lock was not taken in time.
+ */
+int accessCacheTimeout(RefBitClockCache* cache, const char* key, void* value, size_t value_size, int timeout_ms,
+                       CacheValue** out);
+
+/**
+ * @brief lookupCache() that waits at most timeout_ms for the cache lock (thread-safe).
+ *
+ * @param cache The cache instance.
+ * @param key The key to look up.
+ * @param timeout_ms Longest wait for the lock; 0 only tries it.
+ * @param out Receives the held CacheValue* on a hit, NULL on a miss or when busy.
+ * @return REFBIT_CACHE_OK, or REFBIT_CACHE_BUSY if the lock was not taken in time.
+ */
+int lookupCacheTimeout(RefBitClockCache* cache, const char* key, int timeout_ms, CacheValue** out);
+
+/**
+ * @brief lookupCache() that also reports keys known to be missing (thread-safe).
+ * A miss checks the negative cache (negative_entries) without allocating.
+ *
+ * @param cache The cache instance.
+ * @param key The key to look up.
+ * @param out Receives the held CacheValue* on a hit, NULL otherwise.
+ * @return REFBIT_CACHE_MISSING if the key was marked missing and the entry
+ *         has not expired, REFBIT_CACHE_OK otherwise.
+ */
+int lookupCacheStatus(RefBitClockCache* cache, const char* key, CacheValue** out);
+
+/**
+ * @brief Remember that key does not exist upstream (thread-safe).
+ * Only the key's hash is stored, in a direct-mapped table of negative_entries
+ * slots. Caching a value for the key or invalidating it drops the entry.
+ *
+ * @param cache The cache instance.
+ * @param key The missing key.
+ * @return 1 if recorded, 0 if negative caching is disabled or the key is cached.
+ */
+int markCacheMissing(RefBitClockCache* cache, const char* key);
+
+/**
+ * @brief Insert a value, replacing any existing entry for the key (thread-safe).
+ * A replaced value is freed once its last holder releases it. A value that
+ * no_victim_policy returns uncached still removes the existing entry.
+ *
+ * @param cache The cache instance.
+ * @param key The key (string, duplicated internally).
+ * @param value The value to copy into the cache.
+ * @param value_size Size of the value in bytes.
+ * @return Held CacheValue* on success, NULL on failure.
+ */
+CacheValue* insertCache(RefBitClockCache* cache, const char* key, void* value, size_t value_size);
+
+/**
+ * @brief Insert a value that expires ttl_ms after insertion (thread-safe).
+ * Once expired, lookups treat the entry as a miss and the clock prefers it
+ * as a victim. Replaces any existing entry for the key.
+ *
+ * @param cache The cache instance.
+ * @param key The key (string, duplicated internally).
+ * @param value The value to copy into the cache.
+ * @param value_size Size of the value in bytes.
+ * @param ttl_ms Lifetime in milliseconds; 0 never expires.
+ * @return Held CacheValue* on success, NULL on failure.
+ */
+CacheValue* insertCacheWithTTL(RefBitClockCache* cache, const char* key, void* value, size_t value_size, int ttl_ms);
+
+/**
+ * @brief Insert a caller-allocated buffer without copying it (thread-safe).
+ * The cache takes ownership of data and frees it with value_free, also when
+ * the insert fails. Replaces any existing entry for the key.
+ *
+ * @param cache The cache instance.
+ * @param key The key (string, duplicated internally).
+ * @param data Buffer compatible with the cache's value_free.
+ * @param value_size Size of the value in bytes.
+ * @return Held CacheValue* on success, NULL on failure.
+ */
+CacheValue* insertCacheOwned(RefBitClockCache* cache, const char* key, void* data, size_t value_size);
+
+/**
+ * @brief Allocate an uninitialized value of value_size bytes for key.
+ * Fill cv->data in place, then publish it with commitCacheValue() or drop it
+ * with abortCacheValue(). The value is invisible to other tasks until committed.
+ *
+ * @param cache The cache instance.
+ * @param key The key (string, duplicated internally).
+ * @param value_size Size of the value in bytes.
+ * @return Held, unpublished CacheValue* on success, NULL on failure.
+ */
+CacheValue* reserveCacheValue(RefBitClockCache* cache, const char* key, size_t value_size);
+
+/**
+ * @brief Publish a value from reserveCacheValue(), replacing any existing entry (thread-safe).
+ *
+ * @param cache The cache instance.
+ * @param cv The reserved CacheValue.
+ * @return cv, still held by the caller, or NULL if no slot was available
+ *         (cv is then freed).
+ */
+CacheValue* commitCacheValue(RefBitClockCache* cache, CacheValue* cv);
+
+/**
+ * @brief Free a value from reserveCacheValue() that was never committed.
+ *
+ * @param cache The cache instance.
+ * @param cv The reserved CacheValue.
+ */
+void abortCacheValue(RefBitClockCache* cache, CacheValue* cv);
+
+/**
+ * @brief Get a value, calling loader only on a miss (thread-safe).
+ * Tasks that miss the same key concurrently wait for a single loader call
+ * and share its result.
+ *
+ * @param cache The cache instance.
+ * @param key The key to look up or load.
+ * @param loader Called without the cache lock to produce the value on a miss.
+ * @param ctx Opaque pointer passed to loader.
+ * @return Held CacheValue* on success, NULL if the loader failed.
+ */
+CacheValue* getOrLoad(RefBitClockCache* cache, const char* key, CacheLoader loader, void* ctx);
+
+/**
+ * @brief Access or insert n values at once (thread-safe).
+ * Same semantics as accessCache() for every key, but hits are probed in one
+ * pass and all misses are inserted under a single lock acquisition.
+ *
+ * @param cache The cache instance.
+ * @param keys The keys (strings, duplicated internally).
+ * @param values The values to insert for keys that miss.
+ * @param value_sizes Sizes of the values in bytes.
+ * @param n Number of keys.
+ * @param out_cvs Receives a held CacheValue* per key, or NULL on failure.
+ * @return Number of non-NULL entries in out_cvs.
+ */
+int accessCacheBatch(RefBitClockCache* cache, const char* const keys[], void* const values[], const size_t value_sizes[],
+                     int n, CacheValue* out_cvs[]);
+
+/**
+ * @brief Look up n keys at once without inserting them (thread-safe).
+ * Same semantics as lookupCache() for every key; keys not resolved lock-free
+ * are looked up under a single lock acquisition.
+ *
+ * @param cache The cache instance.
+ * @param keys The keys to look up.
+ * @param n Number of keys.
+ * @param out_cvs Receives a held CacheValue* per hit, NULL per miss.
+ * @return Number of hits.
+ */
+int lookupCacheBatch(RefBitClockCache* cache, const char* const keys[], int n, CacheValue* out_cvs[]);
+
+/**
+ * @brief Remove a key from the cache (thread-safe).
+ * A value that is still held stays valid and is freed on its last release.
+ * A known-missing entry for the key is dropped as well.
+ *
+ * @param cache The cache instance.
+ * @param key The key to remove.
+ * @return 1 if the key was cached, 0 otherwise.
+ */
+int invalidateCache(RefBitClockCache* cache, const char* key);
+
+/**
+ * @brief Remove every key starting with prefix in one locked pass (thread-safe).
+ * Drops every known-missing entry, since their keys are not stored.
+ *
+ * @param cache The cache instance.
+ * @param prefix The key prefix; "" removes everything.
+ * @return Number of entries removed.
+ */
+int invalidatePrefix(RefBitClockCache* cache, const char* prefix);
+
+/**
+ * @brief Remove every entry for which predicate returns non-zero in one locked pass (thread-safe).
+ * Drops every known-missing entry, since their keys are not stored.
+ *
+ * @param cache The cache instance.
+ * @param predicate Called for each cached entry with the lock held.
+ * @param ctx Opaque pointer passed to predicate.
+ * @return Number of entries removed.
+ */
+int invalidateIf(RefBitClockCache* cache, CacheKeyPredicate predicate, void* ctx);
+
+/**
+ * @brief Change the number of entries the cache holds without dropping it (thread-safe).
+ * Shrinking evicts surplus entries in clock order; held values that have to
+ * go stay valid and are freed on their last release. The slot arrays and the
+ * hash table are reallocated, so this blocks lock-free readers until the ones
+ * already running finish. The entry pool keeps its creation size.
+ *
+ * @param cache The cache instance.
+ * @param new_size The new maximum number of entries.
+ * @return 1 on success, 0 if new_size is invalid, leaves front entries more than
+ *         half of it, or allocation failed (the cache is unchanged).
+ */
+int resizeCache(RefBitClockCache* cache, int new_size);
+
+/**
+ * @brief Write the cached entries to a stream so a later restoreCache() can warm-start a cache.
+ * Entries are written hottest first (set reference bits, or the highest GCLOCK
+ * counts), in clock order within each level, as a compact length-prefixed
+ * record of key, value bytes and remaining TTL. Only cv->size bytes of each
+ * value are written, so values must not contain pointers. Entries are held, not
+ * locked, while they are written; expired entries are skipped.
+ *
+ * @param cache The cache instance.
+ * @param max_entries Maximum number of entries to write, or 0 for all of them.
+ * @param writer Receives the snapshot bytes.
+ * @param ctx Opaque pointer passed to writer.
+ * @return Number of entries written, or -1 if allocation or the writer failed.
+ */
+int snapshotCache(RefBitClockCache* cache, int max_entries, CacheSnapshotWriter writer, void* ctx);
+
+/**
+ * @brief Load a stream written by snapshotCache() into the cache.
+ * Entries are read outside the lock and published in batches under one lock
+ * each. Keys that are already cached keep their live value, and entries that
+ * find no free slot or would go over max_bytes are skipped, so restoring
+ * never evicts.
+ * The snapshot must come from a cache with the same key_len.
+ *
+ * @param cache The cache instance.
+ * @param reader Supplies the snapshot bytes.
+ * @param ctx Opaque pointer passed to reader.
+ * @return Number of entries restored, or -1 if the snapshot is invalid or
+ *         truncated (entries read before the error stay cached).
+ */
+int restoreCache(RefBitClockCache* cache, CacheSnapshotReader reader, void* ctx);
+
+/**
+ * @brief snapshotCache() over several caches with the same configuration, as one stream.
+ * Entries of all caches are ordered hottest first together, so max_entries
+ * keeps the hottest ones overall. The stream is the same as snapshotCache()
+ * writes, and restoreCache() or restoreCaches() with any number of caches can load it.
+ *
+ * @param caches The cache instances.
+ * @param num_caches Number of caches.
+ * @param max_entries Maximum number of entries to write in total, or 0 for all of them.
+ * @param writer Receives the snapshot bytes.
+ * @param ctx Opaque pointer passed to writer.
+ * @return Number of entries written, or -1 if allocation or the writer failed.
+ */
+int snapshotCaches(RefBitClockCache* const caches[], int num_caches, int max_entries, CacheSnapshotWriter writer,
+                   void* ctx);
+
+/**
+ * @brief restoreCache() into several caches with the same configuration.
+ * Each entry goes to caches[hashCacheKey(caches[0], key) % num_caches], the
+ * cache a ShardedRefBitClockCache with num_caches shards routes the key to.
+ *
+ * @param caches The cache instances.
+ * @param num_caches Number of caches.
+ * @param reader Supplies the snapshot bytes.
+ * @param ctx Opaque pointer passed to reader.
+ * @return Number of entries restored, or -1 if the snapshot is invalid or
+ *         truncated (entries read before the error stay cached).
+ */
+int restoreCaches(RefBitClockCache* const caches[], int num_caches, CacheSnapshotReader reader, void* ctx);
+
+/**
+ * @brief Take held references to the next entries of a walk (thread-safe).
+ * Examines slots from the cursor on under one lock acquisition until max
+ * entries are held, so the lock is released every max entries. Expired
+ * entries are skipped and reference bits are left alone. Entries cached for
+ * the whole walk are returned exactly once; entries inserted or evicted
+ * during it may or may not be, and a resizeCache() during the walk may skip
+ * or repeat entries.
+ *
+ * @param cache The cache instance.
+ * @param cursor The walk position, advanced past the examined slots.
+ * @param out Receives up to max held CacheValues; release them with releaseValueBatch().
+ * @param max Capacity of out.
+ * @return Number of values stored in out; 0 once the walk is complete.
+ */
+int iterateCache(RefBitClockCache* cache, CacheCursor* cursor, CacheValue* out[], int max);
+
+/**
+ * @brief Call visitor for every cached entry (thread-safe).
+ * Entries are taken REFBIT_CACHE_WALK_BATCH at a time with iterateCache(),
+ * so other tasks are never locked out for the whole walk.
+ *
+ * @param cache The cache instance.
+ * @param visitor Called without the lock for each entry.
+ * @param ctx Opaque pointer passed to visitor.
+ * @return Number of entries visited.
+ */
+int forEachCache(RefBitClockCache* cache, CacheVisitor visitor, void* ctx);
+
+/**
+ * @brief Get the key a CacheValue was cached under.
+ * The key stays valid while cv is held; binary keys are key_len bytes.
+ *
+ * @param cv The CacheValue.
+ * @return The key.
+ */
+const char* getCacheValueKey(const CacheValue* cv);
+
 /**
  * @brief Release a CacheValue (decrements refcount).
  * Frees data if refcount reaches 0 and index is -1 (evicted).
@@ -93,6 +810,26 @@ CacheValue* accessCache(RefBitClockCache* cache, const char* key, void* value, s
  */
 void releaseValue(RefBitClockCache* cache, CacheValue* cv);
 
+/**
+ * @brief Release n CacheValues; NULL entries are skipped.
+ * Values freed by the batch are retired under a single lock acquisition.
+ *
+ * @param cache The cache instance.
+ * @param cvs The CacheValues to release.
+ * @param n Number of entries in cvs.
+ */
+void releaseValueBatch(RefBitClockCache* cache, CacheValue* const cvs[], int n);
+
+/**
+ * @brief Run value_free for every value queued by REFBIT_CACHE_FREE_DEFERRED or _TASK.
+ * value_free runs without the lock; the lock is taken once afterwards to
+ * retire the entries. Does nothing with REFBIT_CACHE_FREE_INLINE.
+ *
+ * @param cache The cache instance.
+ * @return Number of values freed.
+ */
+int drainDeferredFrees(RefBitClockCache* cache);
+
 /**
  * @brief Free the entire cache and all its contents.
  *
@@ -102,11 +839,46 @@ void freeCache(RefBitClockCache* cache);
 
 /**
  * @brief Print the current cache state for debugging (logs via ESP_LOGI).
+ * Takes the cache lock, so it is safe to call while other tasks use the cache.
  *
  * @param cache The cache instance.
  */
 void printCacheState(RefBitClockCache* cache);
 
+/**
+ * @brief Take a snapshot of the cache statistics counters.
+ * Counters are read individually without the lock, so a snapshot taken while
+ * other tasks use the cache is not exactly consistent across fields.
+ *
+ * @param cache The cache instance.
+ * @param stats Receives the counters and derived averages.
+ */
+void getCacheStats(RefBitClockCache* cache, RefBitClockCacheStats* stats);
+
+/**
+ * @brief Reset all statistics counters to zero.
+ *
+ * @param cache The cache instance.
+ */
+void resetCacheStats(RefBitClockCache* cache);
+
+/**
+ * @brief Hash of a key as computed by this cache (its hash_fn, integer or FNV-1a hash).
+ *
+ * @param cache The cache instance.
+ * @param key The key.
+ * @return The hash value, as stored in CacheValue::hash.
+ */
+unsigned int hashCacheKey(RefBitClockCache* cache, const char* key);
+
+/**
+ * @brief Full 32-bit FNV-1a hash of a string key, the default bucket hash.
+ *
+ * @param key The key string.
+ * @return The hash value.
+ */
+unsigned int hashKey(const char* key);
+
 /**
  * @brief Default free function for values (uses free()).
  *
@@ -0,0 +1,293 @@
+/*
+ * Implementation of the sharded ESP-IDF C-based Thread-Safe Cache with Clock and Reference Bit Eviction Policy
+ * Copyright (c) 2025 Eungsuk Jeon
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sharded_refbit_clock_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static RefBitClockCache* shardFor(ShardedRefBitClockCache* cache, unsigned int h)
+{
+    return cache->shards[h % cache->num_shards];
+}
+
+ShardedRefBitClockCache* createShardedCacheWithConfig(int num_shards, const RefBitClockCacheConfig* config)
+{
+    if (num_shards < 1 || config->cache_size < num_shards)
+    {
+        ESP_LOGE(CACHE_TAG, "Invalid shard configuration (shards=%d, size=%d)", num_shards, config->cache_size);
+        return NULL;
+    }
+
+    ShardedRefBitClockCache* cache = (ShardedRefBitClockCache*)malloc(sizeof(ShardedRefBitClockCache));
+    if (!cache)
+    {
+        ESP_LOGE(CACHE_TAG, "Failed to allocate sharded cache");
+        return NULL;
+    }
+
+    cache->num_shards = num_shards;
+    cache->shards = (RefBitClockCache**)malloc(num_shards * sizeof(RefBitClockCache*));
+    if (!cache->shards)
+    {
+        ESP_LOGE(CACHE_TAG, "Failed to allocate shard table");
+        free(cache);
+        return NULL;
+    }
+    memset(cache->shards, 0, num_shards * sizeof(RefBitClockCache*));
+
+    // Entry and byte limits are split evenly; every other option applies to each shard.
+    RefBitClockCacheConfig shard_config = *config;
+    shard_config.cache_size = (config->cache_size + num_shards - 1) / num_shards;
+    shard_config.max_bytes = (config->max_bytes + num_shards - 1) / num_shards;
+    for (int i = 0; i < num_shards; i++)
+    {
+        cache->shards[i] = createCacheWithConfig(&shard_config);
+        if (!cache->shards[i])
+        {
+            ESP_LOGE(CACHE_TAG, "Failed to create shard %d", i);
+            freeShardedCache(cache);
+            return NULL;
+        }
+    }
+
+    return cache;
+}
+
+ShardedRefBitClockCache* createShardedCache(int num_shards, int cache_size, void (*value_free)(void*))
+{
+    RefBitClockCacheConfig config = REFBIT_CACHE_DEFAULT_CONFIG();
+    config.cache_size = cache_size;
+    config.value_free = value_free;
+    return createShardedCacheWithConfig(num_shards, &config);
+}
+
+CacheValue* accessShardedCache(ShardedRefBitClockCache* cache, const char* key, void* value, size_t value_size)
+{
+    return accessCache(shardFor(cache, hashCacheKey(cache->shards[0], key)), key, value, value_size);
+}
+
+CacheValue* lookupShardedCache(ShardedRefBitClockCache* cache, const char* key)
+{
+    return lookupCache(shardFor(cache, hashCacheKey(cache->shards[0], key)), key);
+}
+
+int accessShardedCacheTimeout(ShardedRefBitClockCache* cache, const char* key, void* value, size_t value_size,
+                              int timeout_ms, CacheValue** out)
+{
+    return accessCacheTimeout(shardFor(cache, hashCacheKey(cache->shards[0], key)), key, value, value_size, timeout_ms, out);
+}
+
+int lookupShardedCacheTimeout(ShardedRefBitClockCache* cache, const char* key, int timeout_ms, CacheValue** out)
+{
+    return lookupCacheTimeout(shardFor(cache, hashCacheKey(cache->shards[0], key)), key, timeout_ms, out);
+}
+
+int lookupShardedCacheStatus(ShardedRefBitClockCache* cache, const char* key, CacheValue** out)
+{
+    return lookupCacheStatus(shardFor(cache, hashCacheKey(cache->shards[0], key)), key, out);
+}
+
+int markShardedCacheMissing(ShardedRefBitClockCache* cache, const char* key)
+{
+    return markCacheMissing(shardFor(cache, hashCacheKey(cache->shards[0], key)), key);
+}
+
+CacheValue* insertShardedCache(ShardedRefBitClockCache* cache, const char* key, void* value, size_t value_size)
+{
+    return insertCache(shardFor(cache, hashCacheKey(cache->shards[0], key)), key, value, value_size);
+}
+
+CacheValue* getOrLoadSharded(ShardedRefBitClockCache* cache, const char* key, CacheLoader loader, void* ctx)
+{
+    return getOrLoad(shardFor(cache, hashCacheKey(cache->shards[0], key)), key, loader, ctx);
+}
+
+void releaseShardedValue(ShardedRefBitClockCache* cache, CacheValue* cv)
+{
+    if (!cv)
+    {
+        return;
+    }
+
+    releaseValue(shardFor(cache, cv->hash), cv);
+}
+
+int invalidateShardedCache(ShardedRefBitClockCache* cache, const char* key)
+{
+    return invalidateCache(shardFor(cache, hashCacheKey(cache->shards[0], key)), key);
+}
+
+int invalidateShardedPrefix(ShardedRefBitClockCache* cache, const char* prefix)
+{
+    int removed = 0;
+    for (int i = 0; i < cache->num_shards; i++)
+    {
+        removed += invalidatePrefix(cache->shards[i], prefix);
+    }
+    return removed;
+}
+
+int invalidateShardedIf(ShardedRefBitClockCache* cache, CacheKeyPredicate predicate, void* ctx)
+{
+    int removed = 0;
+    for (int i = 0; i < cache->num_shards; i++)
+    {
+        removed += invalidateIf(cache->shards[i], predicate, ctx);
+    }
+    return removed;
+}
+
+int resizeShardedCache(ShardedRefBitClockCache* cache, int new_size)
+{
+    if (new_size < cache->num_shards)
+    {
+        ESP_LOGE(CACHE_TAG, "Invalid sharded cache size %d for %d shards", new_size, cache->num_shards);
+        return 0;
+    }
+
+    int ok = 1;
+    for (int i = 0; i < cache->num_shards; i++)
+    {
+        ok &= resizeCache(cache->shards[i], (new_size + cache->num_shards - 1) / cache->num_shards);
+    }
+    return ok;
+}
+
+int snapshotShardedCache(ShardedRefBitClockCache* cache, int max_entries, CacheSnapshotWriter writer, void* ctx)
+{
+    return snapshotCaches(cache->shards, cache->num_shards, max_entries, writer, ctx);
+}
+
+int restoreShardedCache(ShardedRefBitClockCache* cache, CacheSnapshotReader reader, void* ctx)
+{
+    return restoreCaches(cache->shards, cache->num_shards, reader, ctx);
+}
+
+int iterateShardedCache(ShardedRefBitClockCache* cache, ShardedCacheCursor* cursor, CacheValue* out[], int max)
+{
+    while (cursor->shard < cache->num_shards)
+    {
+        int n = iterateCache(cache->shards[cursor->shard], &cursor->cursor, out, max);
+        if (n > 0)
+        {
+            return n;
+        }
+        cursor->shard++;
+        cursor->cursor.next = 0;
+    }
+    return 0;
+}
+
+int forEachShardedCache(ShardedRefBitClockCache* cache, CacheVisitor visitor, void* ctx)
+{
+    ShardedCacheCursor cursor = SHARDED_CACHE_CURSOR_INIT;
+    CacheValue* batch[REFBIT_CACHE_WALK_BATCH];
+    int visited = 0;
+    int stopped = 0;
+    int n;
+
+    while (!stopped && (n = iterateShardedCache(cache, &cursor, batch, REFBIT_CACHE_WALK_BATCH)) > 0)
+    {
+        for (int i = 0; i < n && !stopped; i++)
+        {
+            visited++;
+            stopped = !visitor(getCacheValueKey(batch[i]), batch[i], ctx);
+        }
+        releaseValueBatch(cache->shards[cursor.shard], batch, n);
+    }
+    return visited;
+}
+
+void freeShardedCache(ShardedRefBitClockCache* cache)
+{
+    for (int i = 0; i < cache->num_shards; i++)
+    {
+        if (cache->shards[i])
+        {
+            freeCache(cache->shards[i]);
+        }
+    }
+
+    free(cache->shards);
+    free(cache);
+}
+
+void getShardedCacheStats(ShardedRefBitClockCache* cache, RefBitClockCacheStats* stats)
+{
+    float sweep_steps = 0.0f;
+    float probe_steps = 0.0f;
+
+    memset(stats, 0, sizeof(RefBitClockCacheStats));
+    for (int i = 0; i < cache->num_shards; i++)
+    {
+        RefBitClockCacheStats shard;
+        getCacheStats(cache->shards[i], &shard);
+
+        stats->hits += shard.hits;
+        stats->misses += shard.misses;
+        stats->evictions += shard.evictions;
+        stats->no_victim += shard.no_victim;
+        stats->deferred_frees += shard.deferred_frees;
+        stats->sweeps += shard.sweeps;
+        stats->probes += shard.probes;
+        stats->rehashes += shard.rehashes;
+        stats->oversized += shard.oversized;
+        stats->expirations += shard.expirations;
+        stats->invalidations += shard.invalidations;
+        stats->queued_frees += shard.queued_frees;
+        stats->front_hits += shard.front_hits;
+        stats->negative_hits += shard.negative_hits;
+        stats->lock_timeouts += shard.lock_timeouts;
+        stats->bytes_used += shard.bytes_used;
+        for (int b = 0; b < REFBIT_CACHE_LOCK_BUCKETS; b++)
+        {
+            stats->lock_wait_hist[b] += shard.lock_wait_hist[b];
+            stats->lock_hold_hist[b] += shard.lock_hold_hist[b];
+        }
+        sweep_steps += shard.avg_sweep * shard.sweeps;
+        probe_steps += shard.avg_probe * shard.probes;
+        if (shard.max_sweep > stats->max_sweep)
+        {
+            stats->max_sweep = shard.max_sweep;
+        }
+        if (shard.max_probe > stats->max_probe)
+        {
+            stats->max_probe = shard.max_probe;
+        }
+        if (shard.max_lock_wait > stats->max_lock_wait)
+        {
+            stats->max_lock_wait = shard.max_lock_wait;
+        }
+        if (shard.max_lock_hold > stats->max_lock_hold)
+        {
+            stats->max_lock_hold = shard.max_lock_hold;
+        }
+    }
+
+    stats->avg_sweep = stats->sweeps ? sweep_steps / stats->sweeps : 0.0f;
+    stats->avg_probe = stats->probes ? probe_steps / stats->probes : 0.0f;
+}
+
+void printShardedCacheState(ShardedRefBitClockCache* cache)
+{
+    for (int i = 0; i < cache->num_shards; i++)
+    {
+        ESP_LOGI(CACHE_TAG, "Shard %d:", i);
+        printCacheState(cache->shards[i]);
+    }
+}
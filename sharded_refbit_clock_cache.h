@@ -0,0 +1,264 @@
+/*
+ * Sharded variant of the ESP-IDF C-based Thread-Safe Cache with Clock and Reference Bit Eviction Policy
+ * Copyright (c) 2025 Eungsuk Jeon
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SHARDED_REF_BIT_CLOCK_CACHE_H
+#define SHARDED_REF_BIT_CLOCK_CACHE_H
+
+#include "refbit_clock_cache.h"
+
+/*
+ * Keys are partitioned by hashCacheKey() into independent RefBitClockCache shards,
+ * each with its own cache arrays, hash table, clock hand and lock, so misses
+ * on different shards evict in parallel.
+ */
+typedef struct
+{
+    int num_shards;
+    RefBitClockCache** shards;
+} ShardedRefBitClockCache;
+
+// Position of an iterateShardedCache() walk; start from SHARDED_CACHE_CURSOR_INIT.
+typedef struct
+{
+    int shard;
+    CacheCursor cursor;
+} ShardedCacheCursor;
+
+#define SHARDED_CACHE_CURSOR_INIT { .shard = 0, .cursor = CACHE_CURSOR_INIT }
+
+/**
+ * @brief Create a new sharded reference bit clock cache.
+ *
+ * @param num_shards Number of independent shards.
+ * @param cache_size The maximum number of entries across all shards.
+ * @param value_free A function to free the user-provided data when evicted.
+ * @return Pointer to the created cache, or NULL on failure.
+ */
+ShardedRefBitClockCache* createShardedCache(int num_shards, int cache_size, void (*value_free)(void*));
+
+/**
+ * @brief Create a new sharded cache from a configuration.
+ * cache_size and max_bytes are totals split evenly across the shards; every
+ * other option applies to each shard as in createCacheWithConfig().
+ *
+ * @param num_shards Number of independent shards.
+ * @param config The configuration for the whole cache.
+ * @return Pointer to the created cache, or NULL on failure.
+ */
+ShardedRefBitClockCache* createShardedCacheWithConfig(int num_shards, const RefBitClockCacheConfig* config);
+
+/**
+ * @brief Access or insert a value in the shard owning the key (thread-safe).
+ * Same semantics as accessCache().
+ *
+ * @param cache The sharded cache instance.
+ * @param key The key (string, duplicated internally).
+ * @param value The value to insert on miss.
+ * @param value_size Size of the value in bytes.
+ * @return CacheValue* on success, NULL on failure.
+ */
+CacheValue* accessShardedCache(ShardedRefBitClockCache* cache, const char* key, void* value, size_t value_size);
+
+/**
+ * @brief Look up a key in its shard without inserting it. Same semantics as lookupCache().
+ *
+ * @param cache The sharded cache instance.
+ * @param key The key to look up.
+ * @return Held CacheValue* on a hit, NULL on a miss.
+ */
+CacheValue* lookupShardedCache(ShardedRefBitClockCache* cache, const char* key);
+
+/**
+ * @brief accessShardedCache() with a lock timeout. Same semantics as accessCacheTimeout().
+ *
+ * @param cache The sharded cache instance.
+ * @param key The key (string, duplicated internally).
+ * @param value The value to insert on miss.
+ * @param value_size Size of the value in bytes.
+ * @param timeout_ms Longest wait for the shard's lock; 0 only tries it.
+ * @param out Receives the result, or NULL when busy.
+ * @return REFBIT_CACHE_OK, or REFBIT_CACHE_BUSY if the lock was not taken in time.
+ */
+int accessShardedCacheTimeout(ShardedRefBitClockCache* cache, const char* key, void* value, size_t value_size,
+                              int timeout_ms, CacheValue** out);
+
+/**
+ * @brief lookupShardedCache() with a lock timeout. Same semantics as lookupCacheTimeout().
+ *
+ * @param cache The sharded cache instance.
+ * @param key The key to look up.
+ * @param timeout_ms Longest wait for the shard's lock; 0 only tries it.
+ * @param out Receives the held CacheValue* on a hit, NULL on a miss or when busy.
+ * @return REFBIT_CACHE_OK, or REFBIT_CACHE_BUSY if the lock was not taken in time.
+ */
+int lookupShardedCacheTimeout(ShardedRefBitClockCache* cache, const char* key, int timeout_ms, CacheValue** out);
+
+/**
+ * @brief lookupShardedCache() that reports known-missing keys. Same semantics as lookupCacheStatus().
+ *
+ * @param cache The sharded cache instance.
+ * @param key The key to look up.
+ * @param out Receives the held CacheValue* on a hit, NULL otherwise.
+ * @return REFBIT_CACHE_MISSING if the key is known missing, REFBIT_CACHE_OK otherwise.
+ */
+int lookupShardedCacheStatus(ShardedRefBitClockCache* cache, const char* key, CacheValue** out);
+
+/**
+ * @brief Remember that key does not exist in its shard. Same semantics as markCacheMissing().
+ *
+ * @param cache The sharded cache instance.
+ * @param key The missing key.
+ * @return 1 if recorded, 0 if negative caching is disabled or the key is cached.
+ */
+int markShardedCacheMissing(ShardedRefBitClockCache* cache, const char* key);
+
+/**
+ * @brief Insert a value into the key's shard. Same semantics as insertCache().
+ *
+ * @param cache The sharded cache instance.
+ * @param key The key (string, duplicated internally).
+ * @param value The value to copy into the cache.
+ * @param value_size Size of the value in bytes.
+ * @return Held CacheValue* on success, NULL on failure.
+ */
+CacheValue* insertShardedCache(ShardedRefBitClockCache* cache, const char* key, void* value, size_t value_size);
+
+/**
+ * @brief Get a value from the key's shard, loading it on a miss. Same semantics as getOrLoad().
+ *
+ * @param cache The sharded cache instance.
+ * @param key The key to look up or load.
+ * @param loader Called without the shard lock to produce the value on a miss.
+ * @param ctx Opaque pointer passed to loader.
+ * @return Held CacheValue* on success, NULL if the loader failed.
+ */
+CacheValue* getOrLoadSharded(ShardedRefBitClockCache* cache, const char* key, CacheLoader loader, void* ctx);
+
+/**
+ * @brief Release a CacheValue obtained from any of the sharded access functions.
+ *
+ * @param cache The sharded cache instance.
+ * @param cv The CacheValue to release.
+ */
+void releaseShardedValue(ShardedRefBitClockCache* cache, CacheValue* cv);
+
+/**
+ * @brief Remove a key from its shard. Same semantics as invalidateCache().
+ *
+ * @param cache The sharded cache instance.
+ * @param key The key to remove.
+ * @return 1 if the key was cached, 0 otherwise.
+ */
+int invalidateShardedCache(ShardedRefBitClockCache* cache, const char* key);
+
+/**
+ * @brief Remove every key starting with prefix, one locked pass per shard.
+ *
+ * @param cache The sharded cache instance.
+ * @param prefix The key prefix.
+ * @return Number of entries removed.
+ */
+int invalidateShardedPrefix(ShardedRefBitClockCache* cache, const char* prefix);
+
+/**
+ * @brief Remove every entry matching predicate, one locked pass per shard.
+ *
+ * @param cache The sharded cache instance.
+ * @param predicate Called for each cached entry with the shard lock held.
+ * @param ctx Opaque pointer passed to predicate.
+ * @return Number of entries removed.
+ */
+int invalidateShardedIf(ShardedRefBitClockCache* cache, CacheKeyPredicate predicate, void* ctx);
+
+/**
+ * @brief Resize every shard to an even share of new_size. Same semantics as resizeCache().
+ *
+ * @param cache The sharded cache instance.
+ * @param new_size The new maximum number of entries across all shards.
+ * @return 1 if every shard was resized, 0 otherwise.
+ */
+int resizeShardedCache(ShardedRefBitClockCache* cache, int new_size);
+
+/**
+ * @brief Snapshot every shard into one stream, hottest entries of all shards first.
+ * The stream has the format of snapshotCache(); see snapshotCaches().
+ *
+ * @param cache The sharded cache instance.
+ * @param max_entries Maximum number of entries to write in total, or 0 for all of them.
+ * @param writer Receives the snapshot bytes.
+ * @param ctx Opaque pointer passed to writer.
+ * @return Number of entries written, or -1 on failure.
+ */
+int snapshotShardedCache(ShardedRefBitClockCache* cache, int max_entries, CacheSnapshotWriter writer, void* ctx);
+
+/**
+ * @brief Restore a stream written by snapshotShardedCache() or snapshotCache().
+ * Every entry is routed to the shard its key hashes to, so the stream may come
+ * from a cache with any number of shards.
+ *
+ * @param cache The sharded cache instance.
+ * @param reader Supplies the snapshot bytes.
+ * @param ctx Opaque pointer passed to reader.
+ * @return Number of entries restored, or -1 if the snapshot is invalid.
+ */
+int restoreShardedCache(ShardedRefBitClockCache* cache, CacheSnapshotReader reader, void* ctx);
+
+/**
+ * @brief Take held references to the next entries of a walk over every shard.
+ * Same semantics as iterateCache(); one call returns entries of one shard.
+ *
+ * @param cache The sharded cache instance.
+ * @param cursor The walk position.
+ * @param out Receives up to max held CacheValues; release them with releaseShardedValue().
+ * @param max Capacity of out.
+ * @return Number of values stored in out; 0 once the walk is complete.
+ */
+int iterateShardedCache(ShardedRefBitClockCache* cache, ShardedCacheCursor* cursor, CacheValue* out[], int max);
+
+/**
+ * @brief Call visitor for every entry of every shard. Same semantics as forEachCache().
+ *
+ * @param cache The sharded cache instance.
+ * @param visitor Called without the shard locks for each entry.
+ * @param ctx Opaque pointer passed to visitor.
+ * @return Number of entries visited.
+ */
+int forEachShardedCache(ShardedRefBitClockCache* cache, CacheVisitor visitor, void* ctx);
+
+/**
+ * @brief Free all shards and their contents.
+ *
+ * @param cache The sharded cache instance.
+ */
+void freeShardedCache(ShardedRefBitClockCache* cache);
+
+/**
+ * @brief Sum the statistics of all shards; maxima are taken across shards.
+ *
+ * @param cache The sharded cache instance.
+ * @param stats Receives the aggregated counters and averages.
+ */
+void getShardedCacheStats(ShardedRefBitClockCache* cache, RefBitClockCacheStats* stats);
+
+/**
+ * @brief Print the state of every shard for debugging (logs via ESP_LOGI).
+ *
+ * @param cache The sharded cache instance.
+ */
+void printShardedCacheState(ShardedRefBitClockCache* cache);
+
+#endif // SHARDED_REF_BIT_CLOCK_CACHE_H
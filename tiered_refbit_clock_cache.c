@@ -0,0 +1,524 @@
+/*
+ * Implementation of the flash-backed second tier for the ESP-IDF C-based Thread-Safe Cache with Clock and Reference Bit Eviction Policy
+ * Copyright (c) 2025 Eungsuk Jeon
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tiered_refbit_clock_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FLASH_TIER_EMPTY UINT32_MAX
+
+/*
+ * Records are 4-byte aligned and never span sectors: a header, then the key
+ * bytes (strings include the NUL), then the value. The smallest record is 16
+ * bytes, which bounds FlashTierBuffer.dead.
+ */
+typedef struct
+{
+    uint16_t key_size;
+    uint16_t reserved;
+    uint32_t value_size;
+    uint32_t hash;
+} FlashRecord;
+
+static size_t recordSize(size_t key_size, size_t value_size)
+{
+    return (sizeof(FlashRecord) + key_size + value_size + 3) & ~(size_t)3;
+}
+
+static size_t tierKeySize(TieredRefBitClockCache* cache, const char* key)
+{
+    return cache->l1->key_len ? cache->l1->key_len : strlen(key) + 1;
+}
+
+static int recordMatches(const FlashRecord* rec, const char* key, size_t key_size, unsigned int hash)
+{
+    return rec->hash == hash && rec->key_size == key_size && memcmp(rec + 1, key, key_size) == 0;
+}
+
+// Index helpers below must be called with the tier lock held.
+static int findIndexSlot(TieredRefBitClockCache* cache, const char* key, size_t key_size, unsigned int hash)
+{
+    for (unsigned int i = hash & cache->index_mask;; i = (i + 1) & cache->index_mask)
+    {
+        const FlashTierSlot* slot = &cache->index[i];
+        if (slot->offset == FLASH_TIER_EMPTY)
+        {
+            return -1;
+        }
+        if (slot->hash == hash && recordMatches((const FlashRecord*)(cache->mapped + slot->offset), key, key_size, hash))
+        {
+            return (int)i;
+        }
+    }
+}
+
+// Backward-shift deletion keeps every probe chain free of holes.
+static void removeIndexSlot(TieredRefBitClockCache* cache, unsigned int i)
+{
+    unsigned int j = i;
+    for (;;)
+    {
+        j = (j + 1) & cache->index_mask;
+        if (cache->index[j].offset == FLASH_TIER_EMPTY)
+        {
+            break;
+        }
+        unsigned int home = cache->index[j].hash & cache->index_mask;
+        if (((j - home) & cache->index_mask) >= ((j - i) & cache->index_mask))
+        {
+            cache->index[i] = cache->index[j];
+            i = j;
+        }
+    }
+    cache->index[i].offset = FLASH_TIER_EMPTY;
+    cache->index_used--;
+}
+
+static int addIndexSlot(TieredRefBitClockCache* cache, unsigned int hash, uint32_t offset)
+{
+    if (cache->index_used >= cache->index_max)
+    {
+        return 0;
+    }
+    unsigned int i = hash & cache->index_mask;
+    while (cache->index[i].offset != FLASH_TIER_EMPTY)
+    {
+        i = (i + 1) & cache->index_mask;
+    }
+    cache->index[i].hash = hash;
+    cache->index[i].offset = offset;
+    cache->index_used++;
+    return 1;
+}
+
+// Forget every record in the sector about to be erased.
+static void dropSector(TieredRefBitClockCache* cache, uint32_t base)
+{
+    unsigned int i = 0;
+    while (i <= cache->index_mask)
+    {
+        uint32_t offset = cache->index[i].offset;
+        if (offset != FLASH_TIER_EMPTY && offset >= base && offset < base + FLASH_TIER_SECTOR_SIZE)
+        {
+            // The shift may pull an unvisited entry into i, so look at i again.
+            removeIndexSlot(cache, i);
+            continue;
+        }
+        i++;
+    }
+}
+
+static int recordDead(const FlashTierBuffer* buf, int n)
+{
+    return (buf->dead[n / 32] >> (n % 32)) & 1;
+}
+
+// Returns the live record's ordinal in buf and its address in *out, or -1.
+static int findBufferRecord(const FlashTierBuffer* buf, const char* key, size_t key_size, unsigned int hash,
+                            const FlashRecord** out)
+{
+    size_t pos = 0;
+    for (int n = 0; n < buf->count; n++)
+    {
+        const FlashRecord* rec = (const FlashRecord*)(buf->data + pos);
+        if (!recordDead(buf, n) && recordMatches(rec, key, key_size, hash))
+        {
+            *out = rec;
+            return n;
+        }
+        pos += recordSize(rec->key_size, rec->value_size);
+    }
+    return -1;
+}
+
+// Flash first, then the staged and in-flight sectors. Tier lock held.
+static const FlashRecord* findRecord(TieredRefBitClockCache* cache, const char* key, size_t key_size, unsigned int hash)
+{
+    int slot = findIndexSlot(cache, key, key_size, hash);
+    if (slot >= 0)
+    {
+        return (const FlashRecord*)(cache->mapped + cache->index[slot].offset);
+    }
+    const FlashRecord* rec = NULL;
+    if (findBufferRecord(&cache->staging, key, key_size, hash, &rec) < 0)
+    {
+        findBufferRecord(&cache->flushing, key, key_size, hash, &rec);
+    }
+    return rec;
+}
+
+// Drop every L2 copy of key. Tier lock held.
+static int forgetKey(TieredRefBitClockCache* cache, const char* key, size_t key_size, unsigned int hash)
+{
+    int found = 0;
+    int slot;
+    // A record promoted while its sector was mid-write can be indexed twice.
+    while ((slot = findIndexSlot(cache, key, key_size, hash)) >= 0)
+    {
+        removeIndexSlot(cache, (unsigned int)slot);
+        found = 1;
+    }
+    // The flushing buffer may be mid-write, so records are marked dead beside it, never in it.
+    FlashTierBuffer* bufs[2] = {&cache->staging, &cache->flushing};
+    for (int b = 0; b < 2; b++)
+    {
+        const FlashRecord* rec;
+        int n;
+        while ((n = findBufferRecord(bufs[b], key, key_size, hash, &rec)) >= 0)
+        {
+            bufs[b]->dead[n / 32] |= 1u << (n % 32);
+            found = 1;
+        }
+    }
+    return found;
+}
+
+// evict_hook of the L1 cache; runs with the L1 lock held, so it only copies into RAM.
+static void demoteValue(const char* key, unsigned int hash, const void* data, size_t size, void* ctx)
+{
+    TieredRefBitClockCache* cache = (TieredRefBitClockCache*)ctx;
+    size_t key_size = tierKeySize(cache, key);
+    size_t record_size = recordSize(key_size, size);
+
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    if (findIndexSlot(cache, key, key_size, hash) >= 0)
+    {
+        // Promoted earlier and unchanged since: the flash copy is still current.
+        xSemaphoreGive(cache->lock);
+        return;
+    }
+    if (record_size > FLASH_TIER_SECTOR_SIZE || cache->staging.len + record_size > FLASH_TIER_SECTOR_SIZE)
+    {
+        cache->stats.dropped++;
+        if (record_size <= FLASH_TIER_SECTOR_SIZE)
+        {
+            __atomic_store_n(&cache->flush_pending, 1, __ATOMIC_RELAXED);
+        }
+        xSemaphoreGive(cache->lock);
+        return;
+    }
+
+    FlashRecord* rec = (FlashRecord*)(cache->staging.data + cache->staging.len);
+    rec->key_size = (uint16_t)key_size;
+    rec->reserved = 0;
+    rec->value_size = (uint32_t)size;
+    rec->hash = hash;
+    memcpy(rec + 1, key, key_size);
+    memcpy((unsigned char*)(rec + 1) + key_size, data, size);
+    memset((unsigned char*)rec + sizeof(FlashRecord) + key_size + size, 0xFF,
+           record_size - sizeof(FlashRecord) - key_size - size);
+    cache->staging.len += record_size;
+    cache->staging.count++;
+    cache->stats.demoted++;
+    if (FLASH_TIER_SECTOR_SIZE - cache->staging.len < sizeof(FlashRecord) + 32)
+    {
+        __atomic_store_n(&cache->flush_pending, 1, __ATOMIC_RELAXED);
+    }
+    xSemaphoreGive(cache->lock);
+}
+
+int flushTieredCache(TieredRefBitClockCache* cache)
+{
+    xSemaphoreTake(cache->flush_lock, portMAX_DELAY);
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    __atomic_store_n(&cache->flush_pending, 0, __ATOMIC_RELAXED);
+    if (cache->staging.count == 0)
+    {
+        xSemaphoreGive(cache->lock);
+        xSemaphoreGive(cache->flush_lock);
+        return 1;
+    }
+
+    // Writers keep staging into the other buffer while this one is written.
+    FlashTierBuffer full = cache->staging;
+    cache->staging = cache->flushing;
+    cache->flushing = full;
+    cache->staging.len = 0;
+    cache->staging.count = 0;
+    memset(cache->staging.dead, 0, sizeof(cache->staging.dead));
+    const unsigned char* data = cache->flushing.data;
+    size_t len = cache->flushing.len;
+    int sector = cache->head_sector;
+    uint32_t base = (uint32_t)sector * FLASH_TIER_SECTOR_SIZE;
+    dropSector(cache, base);
+    xSemaphoreGive(cache->lock);
+
+    esp_err_t err = esp_partition_erase_range(cache->partition, base, FLASH_TIER_SECTOR_SIZE);
+    if (err == ESP_OK)
+    {
+        err = esp_partition_write(cache->partition, base, data, len);
+    }
+
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    if (err == ESP_OK)
+    {
+        size_t pos = 0;
+        for (int n = 0; n < cache->flushing.count; n++)
+        {
+            const FlashRecord* rec = (const FlashRecord*)(data + pos);
+            if (!recordDead(&cache->flushing, n) && !addIndexSlot(cache, rec->hash, base + (uint32_t)pos))
+            {
+                cache->stats.dropped++;
+            }
+            pos += recordSize(rec->key_size, rec->value_size);
+        }
+        cache->head_sector = (sector + 1) % cache->num_sectors;
+        cache->stats.flushes++;
+    }
+    else
+    {
+        // The sector is in an unknown state and stays unindexed; the next flush retries it.
+        ESP_LOGE(CACHE_TAG, "Flash tier write at 0x%lx failed: %s", (unsigned long)base, esp_err_to_name(err));
+    }
+    cache->flushing.len = 0;
+    cache->flushing.count = 0;
+    xSemaphoreGive(cache->lock);
+    xSemaphoreGive(cache->flush_lock);
+    return err == ESP_OK;
+}
+
+static void flushIfPending(TieredRefBitClockCache* cache)
+{
+    if (__atomic_load_n(&cache->flush_pending, __ATOMIC_RELAXED))
+    {
+        flushTieredCache(cache);
+    }
+}
+
+/*
+ * Copy an L2 hit back into L1. Values are never handed out as pointers into
+ * the mapping, since the ring erases sectors under them, so the copy happens
+ * under the tier lock. The locks are taken in the order write lock, L1, tier:
+ * the evict hook runs under the L1 lock, so nothing here calls into L1 while
+ * the tier lock is held. The value is reserved (which may drain deferred frees
+ * under the L1 lock) and committed outside it, and the record is looked up
+ * again before the copy in case a flush moved it in between. The write lock
+ * keeps inserts and invalidations out until the copy is committed, so an older
+ * flash copy never replaces a newer value.
+ */
+static CacheValue* promoteValue(TieredRefBitClockCache* cache, const char* key)
+{
+    unsigned int hash = hashCacheKey(cache->l1, key);
+    size_t key_size = tierKeySize(cache, key);
+
+    xSemaphoreTake(cache->write_lock, portMAX_DELAY);
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    const FlashRecord* rec = findRecord(cache, key, key_size, hash);
+    if (!rec)
+    {
+        cache->stats.misses++;
+        xSemaphoreGive(cache->lock);
+        xSemaphoreGive(cache->write_lock);
+        return NULL;
+    }
+    size_t value_size = rec->value_size;
+    xSemaphoreGive(cache->lock);
+
+    CacheValue* cv = reserveCacheValue(cache->l1, key, value_size);
+    if (!cv)
+    {
+        xSemaphoreGive(cache->write_lock);
+        return NULL;
+    }
+
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    rec = findRecord(cache, key, key_size, hash);
+    if (!rec || rec->value_size != value_size)
+    {
+        cache->stats.misses++;
+        xSemaphoreGive(cache->lock);
+        xSemaphoreGive(cache->write_lock);
+        abortCacheValue(cache->l1, cv);
+        return NULL;
+    }
+    memcpy(cv->data, (const unsigned char*)(rec + 1) + rec->key_size, value_size);
+    cache->stats.hits++;
+    xSemaphoreGive(cache->lock);
+
+    cv = commitCacheValue(cache->l1, cv);
+    xSemaphoreGive(cache->write_lock);
+    return cv;
+}
+
+TieredRefBitClockCache* createTieredCache(const RefBitClockCacheConfig* config, const FlashTierConfig* tier_config)
+{
+    if (tier_config->index_entries < 1)
+    {
+        ESP_LOGE(CACHE_TAG, "Invalid flash tier index size %d", tier_config->index_entries);
+        return NULL;
+    }
+
+    const esp_partition_t* partition =
+        esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, tier_config->partition_label);
+    if (!partition || partition->size < FLASH_TIER_SECTOR_SIZE)
+    {
+        ESP_LOGE(CACHE_TAG, "Flash tier partition '%s' not found or too small", tier_config->partition_label);
+        return NULL;
+    }
+
+    TieredRefBitClockCache* cache = (TieredRefBitClockCache*)malloc(sizeof(TieredRefBitClockCache));
+    if (!cache)
+    {
+        ESP_LOGE(CACHE_TAG, "Failed to allocate tiered cache");
+        return NULL;
+    }
+    memset(cache, 0, sizeof(TieredRefBitClockCache));
+    cache->partition = partition;
+    cache->num_sectors = (int)(partition->size / FLASH_TIER_SECTOR_SIZE);
+
+    unsigned int index_size = 2;
+    while (index_size < (unsigned int)tier_config->index_entries * 2)
+    {
+        index_size <<= 1;
+    }
+    cache->index_mask = index_size - 1;
+    cache->index_max = tier_config->index_entries;
+    cache->index = (FlashTierSlot*)malloc(index_size * sizeof(FlashTierSlot));
+    cache->staging.data = (unsigned char*)malloc(FLASH_TIER_SECTOR_SIZE);
+    cache->flushing.data = (unsigned char*)malloc(FLASH_TIER_SECTOR_SIZE);
+    cache->lock = xSemaphoreCreateMutex();
+    cache->flush_lock = xSemaphoreCreateMutex();
+    cache->write_lock = xSemaphoreCreateMutex();
+    if (!cache->index || !cache->staging.data || !cache->flushing.data || !cache->lock || !cache->flush_lock ||
+        !cache->write_lock)
+    {
+        ESP_LOGE(CACHE_TAG, "Failed to allocate flash tier");
+        freeTieredCache(cache);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < index_size; i++)
+    {
+        cache->index[i].offset = FLASH_TIER_EMPTY;
+    }
+
+    const void* mapped;
+    esp_err_t err = esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA, &mapped, &cache->map_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(CACHE_TAG, "Failed to map flash tier partition: %s", esp_err_to_name(err));
+        freeTieredCache(cache);
+        return NULL;
+    }
+    cache->mapped = (const unsigned char*)mapped;
+
+    RefBitClockCacheConfig l1_config = *config;
+    l1_config.evict_hook = demoteValue;
+    l1_config.evict_ctx = cache;
+    cache->l1 = createCacheWithConfig(&l1_config);
+    if (!cache->l1)
+    {
+        freeTieredCache(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+CacheValue* lookupTieredCache(TieredRefBitClockCache* cache, const char* key)
+{
+    CacheValue* cv = lookupCache(cache->l1, key);
+    if (!cv)
+    {
+        cv = promoteValue(cache, key);
+    }
+    flushIfPending(cache);
+    return cv;
+}
+
+CacheValue* accessTieredCache(TieredRefBitClockCache* cache, const char* key, void* value, size_t value_size)
+{
+    CacheValue* cv = lookupCache(cache->l1, key);
+    if (!cv)
+    {
+        cv = promoteValue(cache, key);
+    }
+    if (!cv)
+    {
+        cv = accessCache(cache->l1, key, value, value_size);
+    }
+    flushIfPending(cache);
+    return cv;
+}
+
+CacheValue* insertTieredCache(TieredRefBitClockCache* cache, const char* key, void* value, size_t value_size)
+{
+    // L1 goes first so that an old value demoted before the insert is forgotten as well.
+    xSemaphoreTake(cache->write_lock, portMAX_DELAY);
+    CacheValue* cv = insertCache(cache->l1, key, value, value_size);
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    forgetKey(cache, key, tierKeySize(cache, key), hashCacheKey(cache->l1, key));
+    xSemaphoreGive(cache->lock);
+    xSemaphoreGive(cache->write_lock);
+    flushIfPending(cache);
+    return cv;
+}
+
+int invalidateTieredCache(TieredRefBitClockCache* cache, const char* key)
+{
+    xSemaphoreTake(cache->write_lock, portMAX_DELAY);
+    int found = invalidateCache(cache->l1, key);
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    found |= forgetKey(cache, key, tierKeySize(cache, key), hashCacheKey(cache->l1, key));
+    xSemaphoreGive(cache->lock);
+    xSemaphoreGive(cache->write_lock);
+    return found;
+}
+
+void releaseTieredValue(TieredRefBitClockCache* cache, CacheValue* cv)
+{
+    releaseValue(cache->l1, cv);
+}
+
+void getTieredCacheStats(TieredRefBitClockCache* cache, FlashTierStats* stats)
+{
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    *stats = cache->stats;
+    xSemaphoreGive(cache->lock);
+}
+
+void freeTieredCache(TieredRefBitClockCache* cache)
+{
+    if (!cache)
+    {
+        return;
+    }
+    // Freeing L1 does not run the evict hook, so the tier can go after it.
+    if (cache->l1)
+    {
+        freeCache(cache->l1);
+    }
+    if (cache->mapped)
+    {
+        esp_partition_munmap(cache->map_handle);
+    }
+    if (cache->lock)
+    {
+        vSemaphoreDelete(cache->lock);
+    }
+    if (cache->flush_lock)
+    {
+        vSemaphoreDelete(cache->flush_lock);
+    }
+    if (cache->write_lock)
+    {
+        vSemaphoreDelete(cache->write_lock);
+    }
+    free(cache->staging.data);
+    free(cache->flushing.data);
+    free(cache->index);
+    free(cache);
+}
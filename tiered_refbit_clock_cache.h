@@ -0,0 +1,177 @@
+/*
+ * Flash-backed second tier for the ESP-IDF C-based Thread-Safe Cache with Clock and Reference Bit Eviction Policy
+ * Copyright (c) 2025 Eungsuk Jeon
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TIERED_REF_BIT_CLOCK_CACHE_H
+#define TIERED_REF_BIT_CLOCK_CACHE_H
+
+#include "refbit_clock_cache.h"
+#include <esp_partition.h>
+
+/*
+ * Values the RAM cache (L1) evicts while nobody holds them are staged in RAM
+ * and written one flash sector at a time to a ring on a data partition (L2).
+ * The partition is memory-mapped, so an L1 miss that hits L2 is read straight
+ * from the mapping and promoted back into L1. L2 contents do not survive a
+ * reboot; use snapshotCache() for warm starts.
+ */
+#define FLASH_TIER_SECTOR_SIZE 4096
+
+typedef struct
+{
+    const char* partition_label;  // Data partition holding the ring; it is erased as the ring advances.
+    int index_entries;            // Maximum number of values indexed in flash.
+} FlashTierConfig;
+
+#define FLASH_TIER_DEFAULT_CONFIG()     \
+    {                                   \
+        .partition_label = "cache_l2",  \
+        .index_entries = 256,           \
+    }
+
+typedef struct
+{
+    unsigned int hits;      // L1 misses served from L2.
+    unsigned int misses;    // L1 misses L2 could not serve either.
+    unsigned int demoted;   // Evicted values staged for flash.
+    unsigned int dropped;   // Evicted values not staged: too large, staging full, or index full.
+    unsigned int flushes;   // Sectors written.
+} FlashTierStats;
+
+typedef struct
+{
+    unsigned int hash;
+    uint32_t offset;  // Record offset in the partition; FLASH_TIER_EMPTY marks a free slot.
+} FlashTierSlot;
+
+// One sector's worth of records in RAM; dead marks records invalidated before they were indexed.
+typedef struct
+{
+    unsigned char* data;
+    size_t len;
+    int count;
+    uint32_t dead[FLASH_TIER_SECTOR_SIZE / 16 / 32];
+} FlashTierBuffer;
+
+typedef struct
+{
+    RefBitClockCache* l1;
+    const esp_partition_t* partition;
+    const unsigned char* mapped;
+    esp_partition_mmap_handle_t map_handle;
+    int num_sectors;
+    int head_sector;
+    FlashTierSlot* index;
+    unsigned int index_mask;
+    int index_used;
+    int index_max;
+    FlashTierBuffer staging;
+    FlashTierBuffer flushing;
+    int flush_pending;
+    SemaphoreHandle_t lock;
+    SemaphoreHandle_t flush_lock;
+    SemaphoreHandle_t write_lock;
+    FlashTierStats stats;
+} TieredRefBitClockCache;
+
+/**
+ * @brief Create a RAM cache backed by a flash tier.
+ * config describes the RAM cache as in createCacheWithConfig(); its
+ * evict_hook is taken over by the tier. L2 compares keys byte for byte, so
+ * key_equal must agree with memcmp().
+ *
+ * @param config The RAM cache configuration.
+ * @param tier_config The flash tier configuration.
+ * @return Pointer to the created cache, or NULL on failure.
+ */
+TieredRefBitClockCache* createTieredCache(const RefBitClockCacheConfig* config, const FlashTierConfig* tier_config);
+
+/**
+ * @brief Access a key, trying L1, then L2, then inserting value (thread-safe).
+ * Same semantics as accessCache().
+ *
+ * @param cache The tiered cache instance.
+ * @param key The key.
+ * @param value The value to insert if neither tier has the key.
+ * @param value_size Size of the value in bytes.
+ * @return Held CacheValue* on success, NULL on failure.
+ */
+CacheValue* accessTieredCache(TieredRefBitClockCache* cache, const char* key, void* value, size_t value_size);
+
+/**
+ * @brief Look up a key in L1 and then L2 without inserting a new value (thread-safe).
+ * An L2 hit is copied back into L1.
+ *
+ * @param cache The tiered cache instance.
+ * @param key The key to look up.
+ * @return Held CacheValue* on a hit, NULL on a miss.
+ */
+CacheValue* lookupTieredCache(TieredRefBitClockCache* cache, const char* key);
+
+/**
+ * @brief Insert or replace a value; any older copy in L2 is dropped (thread-safe).
+ *
+ * @param cache The tiered cache instance.
+ * @param key The key.
+ * @param value The value to copy into the cache.
+ * @param value_size Size of the value in bytes.
+ * @return Held CacheValue* on success, NULL on failure.
+ */
+CacheValue* insertTieredCache(TieredRefBitClockCache* cache, const char* key, void* value, size_t value_size);
+
+/**
+ * @brief Remove a key from both tiers (thread-safe).
+ *
+ * @param cache The tiered cache instance.
+ * @param key The key to remove.
+ * @return 1 if either tier had the key, 0 otherwise.
+ */
+int invalidateTieredCache(TieredRefBitClockCache* cache, const char* key);
+
+/**
+ * @brief Release a CacheValue obtained from the tiered access functions.
+ *
+ * @param cache The tiered cache instance.
+ * @param cv The CacheValue to release.
+ */
+void releaseTieredValue(TieredRefBitClockCache* cache, CacheValue* cv);
+
+/**
+ * @brief Write the staged evictions to the next sector of the ring.
+ * The access functions flush on their own once a sector's worth is staged;
+ * call this to push a partial sector out, e.g. before sleeping.
+ *
+ * @param cache The tiered cache instance.
+ * @return 1 on success or if nothing was staged, 0 if the flash write failed.
+ */
+int flushTieredCache(TieredRefBitClockCache* cache);
+
+/**
+ * @brief Read the flash tier counters; use getCacheStats(cache->l1, ...) for L1.
+ *
+ * @param cache The tiered cache instance.
+ * @param stats Receives a copy of the counters.
+ */
+void getTieredCacheStats(TieredRefBitClockCache* cache, FlashTierStats* stats);
+
+/**
+ * @brief Free both tiers. Staged evictions are discarded and the partition is unmapped.
+ *
+ * @param cache The tiered cache instance.
+ */
+void freeTieredCache(TieredRefBitClockCache* cache);
+
+#endif // TIERED_REF_BIT_CLOCK_CACHE_H
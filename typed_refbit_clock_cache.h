@@ -0,0 +1,309 @@
+/*
+ * Type-specialized variant of the ESP-IDF C-based Thread-Safe Cache with Clock and Reference Bit Eviction Policy
+ * Copyright (c) 2025 Eungsuk Jeon
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TYPED_REF_BIT_CLOCK_CACHE_H
+#define TYPED_REF_BIT_CLOCK_CACHE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+
+/*
+ * REFBIT_CACHE_DEFINE(name, KeyType, ValueType, hash_fn, eq_fn, capacity)
+ * generates a cache type `name` with the same clock and reference bit
+ * eviction as RefBitClockCache, specialized for one key and value type:
+ *
+ *   REFBIT_CACHE_DEFINE(SensorCache, uint32_t, SensorReading, typedCacheHashU32, typedCacheEqualU32, 64)
+ *
+ *   static SensorCache sensors;
+ *   initSensorCache(&sensors);
+ *   accessSensorCache(&sensors, id, &reading, &out);
+ *
+ * Keys and values are stored by value in fixed arrays inside the struct, so
+ * the cache needs no heap and no value_free. capacity must be a power of two
+ * from 2 to 32768; the hash table has 2 * capacity buckets and is indexed with
+ * a mask. hash_fn(KeyType) returns unsigned int and eq_fn(KeyType, KeyType)
+ * returns non-zero for equal keys; both are called directly and can be
+ * inlined.
+ *
+ * There are no held references: lookups copy the value out. Every operation
+ * runs inside a portMUX critical section, so ValueType should be small and
+ * none of the functions may be called from an ISR.
+ *
+ * Generated functions, for name = SensorCache:
+ *   void initSensorCache(SensorCache* c);
+ *   int lookupSensorCache(SensorCache* c, KeyType key, ValueType* out);
+ *       1 and a copy in *out on a hit (sets the reference bit), 0 on a miss.
+ *   int accessSensorCache(SensorCache* c, KeyType key, const ValueType* value, ValueType* out);
+ *       Like lookup; a miss stores *value, evicting by the clock if full, and
+ *       copies it to *out. out may be NULL. Returns 1 on a hit, 0 on a miss.
+ *   void insertSensorCache(SensorCache* c, KeyType key, const ValueType* value);
+ *       Stores or replaces the value for key.
+ *   int invalidateSensorCache(SensorCache* c, KeyType key);
+ *       Removes key; returns 1 if it was cached.
+ *   void clearSensorCache(SensorCache* c);
+ *       Removes every entry.
+ * The hits, misses and evictions fields count what their names say.
+ */
+
+// Multiplicative hashes for integer keys, folded like the int_keys hash of RefBitClockCache.
+static inline unsigned int typedCacheHashU32(uint32_t key)
+{
+    unsigned int h = key * 2654435769u;
+    return h ^ (h >> 16);
+}
+
+static inline unsigned int typedCacheHashU64(uint64_t key)
+{
+    unsigned int h = (unsigned int)((key * 0x9E3779B97F4A7C15ull) >> 32);
+    return h ^ (h >> 16);
+}
+
+static inline int typedCacheEqualU32(uint32_t a, uint32_t b)
+{
+    return a == b;
+}
+
+static inline int typedCacheEqualU64(uint64_t a, uint64_t b)
+{
+    return a == b;
+}
+
+#define REFBIT_CACHE_DEFINE(name, KeyType, ValueType, hash_fn, eq_fn, capacity)                              \
+    _Static_assert((capacity) >= 2 && (capacity) <= 32768 && ((capacity) & ((capacity) - 1)) == 0,           \
+                   #name ": capacity must be a power of two from 2 to 32768");                               \
+                                                                                                             \
+    typedef struct                                                                                           \
+    {                                                                                                        \
+        KeyType keys[capacity];                                                                              \
+        ValueType values[capacity];                                                                          \
+        unsigned int hashes[capacity];                                                                       \
+        uint16_t table[2 * (capacity)]; /* Slot + 1 per bucket; 0 = empty. */                                \
+        uint16_t free_slots[capacity];                                                                       \
+        uint32_t ref_bits[((capacity) + 31) / 32];                                                           \
+        int free_count;                                                                                      \
+        int clock_hand;                                                                                      \
+        unsigned int hits;                                                                                   \
+        unsigned int misses;                                                                                 \
+        unsigned int evictions;                                                                              \
+        portMUX_TYPE lock;                                                                                   \
+    } name;                                                                                                  \
+                                                                                                             \
+    static inline void init##name(name* c)                                                                   \
+    {                                                                                                        \
+        memset(c, 0, sizeof(name));                                                                          \
+        for (int i = 0; i < (capacity); i++)                                                                 \
+        {                                                                                                    \
+            c->free_slots[i] = (uint16_t)((capacity) - 1 - i);                                               \
+        }                                                                                                    \
+        c->free_count = (capacity);                                                                          \
+        portMUX_INITIALIZE(&c->lock);                                                                        \
+    }                                                                                                        \
+                                                                                                             \
+    /* Internal helpers; callers hold c->lock. */                                                            \
+    static inline int name##Find(name* c, KeyType key, unsigned int h)                                       \
+    {                                                                                                        \
+        unsigned int b = h & (2 * (capacity) - 1);                                                           \
+        while (c->table[b])                                                                                  \
+        {                                                                                                    \
+            int slot = c->table[b] - 1;                                                                      \
+            if (c->hashes[slot] == h && eq_fn(c->keys[slot], key))                                           \
+            {                                                                                                \
+                return (int)b;                                                                               \
+            }                                                                                                \
+            b = (b + 1) & (2 * (capacity) - 1);                                                              \
+        }                                                                                                    \
+        return -1;                                                                                           \
+    }                                                                                                        \
+                                                                                                             \
+    static inline unsigned int name##BucketOf(name* c, int slot)                                             \
+    {                                                                                                        \
+        unsigned int b = c->hashes[slot] & (2 * (capacity) - 1);                                             \
+        while (c->table[b] != slot + 1)                                                                      \
+        {                                                                                                    \
+            b = (b + 1) & (2 * (capacity) - 1);                                                              \
+        }                                                                                                    \
+        return b;                                                                                            \
+    }                                                                                                        \
+                                                                                                             \
+    /* Backward-shift deletion, as for fixed RefBitClockCache tables. */                                     \
+    static inline void name##EraseBucket(name* c, unsigned int hole)                                         \
+    {                                                                                                        \
+        unsigned int j = hole;                                                                               \
+        while (1)                                                                                            \
+        {                                                                                                    \
+            j = (j + 1) & (2 * (capacity) - 1);                                                              \
+            if (!c->table[j])                                                                                \
+            {                                                                                                \
+                break;                                                                                       \
+            }                                                                                                \
+            unsigned int home = c->hashes[c->table[j] - 1] & (2 * (capacity) - 1);                           \
+            int stays = hole <= j ? (home > hole && home <= j) : (home > hole || home <= j);                 \
+            if (!stays)                                                                                      \
+            {                                                                                                \
+                c->table[hole] = c->table[j];                                                                \
+                hole = j;                                                                                    \
+            }                                                                                                \
+        }                                                                                                    \
+        c->table[hole] = 0;                                                                                  \
+    }                                                                                                        \
+                                                                                                             \
+    /* Every slot is occupied and evictable, so one pass of the hand finds a victim. */                      \
+    static inline int name##Victim(name* c)                                                                  \
+    {                                                                                                        \
+        const int span = (capacity) < 32 ? (capacity) : 32;                                                  \
+        while (1)                                                                                            \
+        {                                                                                                    \
+            int word = c->clock_hand / 32;                                                                   \
+            int first = c->clock_hand % 32;                                                                  \
+            uint32_t window = (span == 32 ? ~0u : (1u << span) - 1) & ~((1u << first) - 1);                  \
+            uint32_t refs = c->ref_bits[word] & window;                                                      \
+            uint32_t candidates = ~refs & window;                                                            \
+            if (!candidates)                                                                                 \
+            {                                                                                                \
+                c->ref_bits[word] &= ~refs;                                                                  \
+                c->clock_hand = (word * 32 + span) & ((capacity) - 1);                                       \
+                continue;                                                                                    \
+            }                                                                                                \
+            int bit = __builtin_ctz(candidates);                                                             \
+            c->ref_bits[word] &= ~(refs & ((1u << bit) - 1));                                                \
+            int idx = word * 32 + bit;                                                                       \
+            c->clock_hand = (idx + 1) & ((capacity) - 1);                                                    \
+            return idx;                                                                                      \
+        }                                                                                                    \
+    }                                                                                                        \
+                                                                                                             \
+    static inline void name##Store(name* c, KeyType key, unsigned int h, const ValueType* value)             \
+    {                                                                                                        \
+        int b = name##Find(c, key, h);                                                                       \
+        int slot;                                                                                            \
+        if (b >= 0)                                                                                          \
+        {                                                                                                    \
+            slot = c->table[b] - 1;                                                                          \
+        }                                                                                                    \
+        else                                                                                                 \
+        {                                                                                                    \
+            if (c->free_count > 0)                                                                           \
+            {                                                                                                \
+                slot = c->free_slots[--c->free_count];                                                       \
+            }                                                                                                \
+            else                                                                                             \
+            {                                                                                                \
+                slot = name##Victim(c);                                                                      \
+                name##EraseBucket(c, name##BucketOf(c, slot));                                               \
+                c->evictions++;                                                                              \
+            }                                                                                                \
+            unsigned int e = h & (2 * (capacity) - 1);                                                       \
+            while (c->table[e])                                                                              \
+            {                                                                                                \
+                e = (e + 1) & (2 * (capacity) - 1);                                                          \
+            }                                                                                                \
+            c->table[e] = (uint16_t)(slot + 1);                                                              \
+            c->keys[slot] = key;                                                                             \
+            c->hashes[slot] = h;                                                                             \
+        }                                                                                                    \
+        c->values[slot] = *value;                                                                            \
+        c->ref_bits[slot / 32] |= 1u << (slot % 32);                                                         \
+    }                                                                                                        \
+                                                                                                             \
+    static inline int lookup##name(name* c, KeyType key, ValueType* out)                                     \
+    {                                                                                                        \
+        unsigned int h = hash_fn(key);                                                                       \
+        portENTER_CRITICAL(&c->lock);                                                                        \
+        int b = name##Find(c, key, h);                                                                       \
+        if (b >= 0)                                                                                          \
+        {                                                                                                    \
+            int slot = c->table[b] - 1;                                                                      \
+            *out = c->values[slot];                                                                          \
+            c->ref_bits[slot / 32] |= 1u << (slot % 32);                                                     \
+            c->hits++;                                                                                       \
+        }                                                                                                    \
+        else                                                                                                 \
+        {                                                                                                    \
+            c->misses++;                                                                                     \
+        }                                                                                                    \
+        portEXIT_CRITICAL(&c->lock);                                                                         \
+        return b >= 0;                                                                                       \
+    }                                                                                                        \
+                                                                                                             \
+    static inline int access##name(name* c, KeyType key, const ValueType* value, ValueType* out)             \
+    {                                                                                                        \
+        unsigned int h = hash_fn(key);                                                                       \
+        portENTER_CRITICAL(&c->lock);                                                                        \
+        int b = name##Find(c, key, h);                                                                       \
+        if (b >= 0)                                                                                          \
+        {                                                                                                    \
+            int slot = c->table[b] - 1;                                                                      \
+            if (out)                                                                                         \
+            {                                                                                                \
+                *out = c->values[slot];                                                                      \
+            }                                                                                                \
+            c->ref_bits[slot / 32] |= 1u << (slot % 32);                                                     \
+            c->hits++;                                                                                       \
+        }                                                                                                    \
+        else                                                                                                 \
+        {                                                                                                    \
+            name##Store(c, key, h, value);                                                                   \
+            c->misses++;                                                                                     \
+            if (out)                                                                                         \
+            {                                                                                                \
+                *out = *value;                                                                               \
+            }                                                                                                \
+        }                                                                                                    \
+        portEXIT_CRITICAL(&c->lock);                                                                         \
+        return b >= 0;                                                                                       \
+    }                                                                                                        \
+                                                                                                             \
+    static inline void insert##name(name* c, KeyType key, const ValueType* value)                            \
+    {                                                                                                        \
+        unsigned int h = hash_fn(key);                                                                       \
+        portENTER_CRITICAL(&c->lock);                                                                        \
+        name##Store(c, key, h, value);                                                                       \
+        portEXIT_CRITICAL(&c->lock);                                                                         \
+    }                                                                                                        \
+                                                                                                             \
+    static inline int invalidate##name(name* c, KeyType key)                                                 \
+    {                                                                                                        \
+        unsigned int h = hash_fn(key);                                                                       \
+        portENTER_CRITICAL(&c->lock);                                                                        \
+        int b = name##Find(c, key, h);                                                                       \
+        if (b >= 0)                                                                                          \
+        {                                                                                                    \
+            int slot = c->table[b] - 1;                                                                      \
+            name##EraseBucket(c, (unsigned int)b);                                                           \
+            c->ref_bits[slot / 32] &= ~(1u << (slot % 32));                                                  \
+            c->free_slots[c->free_count++] = (uint16_t)slot;                                                 \
+        }                                                                                                    \
+        portEXIT_CRITICAL(&c->lock);                                                                         \
+        return b >= 0;                                                                                       \
+    }                                                                                                        \
+                                                                                                             \
+    static inline void clear##name(name* c)                                                                  \
+    {                                                                                                        \
+        portENTER_CRITICAL(&c->lock);                                                                        \
+        memset(c->table, 0, sizeof(c->table));                                                               \
+        memset(c->ref_bits, 0, sizeof(c->ref_bits));                                                         \
+        for (int i = 0; i < (capacity); i++)                                                                 \
+        {                                                                                                    \
+            c->free_slots[i] = (uint16_t)((capacity) - 1 - i);                                               \
+        }                                                                                                    \
+        c->free_count = (capacity);                                                                          \
+        c->clock_hand = 0;                                                                                   \
+        portEXIT_CRITICAL(&c->lock);                                                                         \
+    }
+
+#endif // TYPED_REF_BIT_CLOCK_CACHE_H